@@ -0,0 +1,32 @@
+import * as dsp_c from 'dsp_c'
+
+// the main thread's side of the command queue, the audio thread applies these
+// at the start of its next block. each returns false if the queue was full
+
+// wakes the audio thread so a command doesn't wait out its sleep
+const send = (type: dsp_c.CommandType, target: number, value?: number) => {
+  const sent = dsp_c.send_command(type, target, value)
+  if (sent) {
+    dsp_c.wake()
+  }
+  return sent
+}
+
+// sets the value bound with dsp.parameter(id)
+export const set_value = (id: number, value: number) => {
+  return send('set_value', id, value)
+}
+
+// switches a dsp.connection(id, input) on or off
+export const connect = (id: number) => {
+  return send('connect', id)
+}
+
+export const disconnect = (id: number) => {
+  return send('disconnect', id)
+}
+
+// replaces the playing graph with the patch defined by dsp.define_patch(id)
+export const swap_patch = (id: number) => {
+  return send('swap_graph', id)
+}
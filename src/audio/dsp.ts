@@ -1,30 +1,113 @@
 //// stream //////////////////////////////////////
 
 import * as dsp_c from 'dsp_c'
+import * as ffi from 'ffi'
+
+// calls into dsp_c abort jit traces, so under luajit what runs every block and
+// every event goes through the c abi in dsp_ffi.h instead. it has to be the
+// library require loaded, which was found on package.cpath, or its state
+// wouldn't be ours. its functions return -1 or false where dsp_c's lua
+// functions have to do the work, e.g. to call back into lua or raise an error
+type Native = {
+  dsp_node_process: (this: void, node: ffi.CData, sample_count: number) => number
+  dsp_graph_process: (this: void, graph: ffi.CData, sample_count: number) => number
+  dsp_set_value: (this: void, node: ffi.CData, value: number, offset: number) => boolean
+  dsp_adsr_set_gate: (this: void, node: ffi.CData, gate: boolean, offset: number) => boolean
+  dsp_voice_pool_note_on: (this: void, node: ffi.CData, note: number, frequency: number, velocity: number, offset: number) => boolean
+  dsp_voice_pool_note_off: (this: void, node: ffi.CData, note: number, offset: number) => boolean
+}
+
+const load_native = (): Native | undefined => {
+  const searchpath: ((this: void, name: string, path: string) => string | undefined) | undefined = (package as any).searchpath
+  if (jit === undefined || searchpath === undefined) {
+    return undefined
+  }
+  const path = searchpath('dsp_c', package.cpath)
+  if (path === undefined) {
+    return undefined
+  }
+  ffi.cdef(dsp_c.get_ffi_cdef())
+  return ffi.load(path)
+}
+
+const native = load_native()
+
+const node_pointer = (node: dsp_c.Node) => {
+  return native !== undefined ? ffi.cast('dsp_node *', node) : undefined
+}
 
 export type Stream = LuaUserdata & { __pointer_type: 'stream' }
+// a pair of mono streams or one stream with 2 channels, which multichannel
+// nodes process in one call
+export type Stereo = [Stream, Stream] | Stream
 export type ValueOf<T> = [T]
 export type Value = ValueOf<number>
 
+// values live in dsp_c so nodes can read them without calling back into lua
+export const new_value = (value = 0): Value => {
+  return dsp_c.new_value(value)
+}
+
+// runs at the device's rate so nothing has to be resampled after us
+dsp_c.set_sample_rate(lovr.audio.getSampleRate())
+// this thread and the graph's workers flush denormals to zero, so decaying
+// tails don't stall
+dsp_c.flush_denormals()
 export const sample_rate = dsp_c.get_sample_rate()
-export const max_block_size = 512
+// blocks are at most max_block_size samples, which can only change before
+// any stream is made. smaller blocks mean less latency, bigger ones less
+// overhead for rendering offline
+export let max_block_size = dsp_c.get_max_block_size()
 export const sizeof_sample = 4 // f32
 
 let current_block_size = 0
 
-// keep references to blobs so they don't get collected
-const stream_blobs: Blob[] = []
-
-export const new_stream = (value = 0): Stream => {
-  const blob = lovr.data.newBlob(sizeof_sample * max_block_size, 'stream')
-  stream_blobs.push(blob)
-  const stream = blob.getPointer() as Stream
-  dsp_c.set({
-    sample_count: max_block_size,
-    output: stream,
-    value: value
-  })
-  return stream
+// streams are aligned buffers allocated by dsp_c, nodes keep the streams they
+// use alive. new_stream() makes a stream for a node to write into, and
+// new_stream(value) makes a constant stream without a buffer, which lets nodes
+// skip per sample work
+//
+// once the graph runs, streams that are written and then read within the
+// block share buffers from an arena in the graph, so only streams that are
+// live at the same time take up separate memory
+export const new_stream = (value?: number): Stream => {
+  if (value === undefined) {
+    return dsp_c.new_stream() as Stream
+  }
+  return dsp_c.new_constant(value) as Stream
+}
+
+// a stream with several channels, for nodes that process all of them in one
+// call
+export const new_multichannel_stream = (channel_count: number): Stream => {
+  return dsp_c.new_stream(channel_count) as Stream
+}
+
+export const get_channel_count = (stream: Stream) => {
+  return dsp_c.get_channel_count(stream)
+}
+
+// a stream with as many channels as the widest input
+const new_stream_like = (inputs: Stream[]) => {
+  let channel_count = 1
+  for (const input of inputs) {
+    channel_count = math.max(channel_count, dsp_c.get_channel_count(input))
+  }
+  return new_multichannel_stream(channel_count)
+}
+
+// the state fields stereo nodes read it from
+const stereo_inputs = (stereo: Stereo) => {
+  return Array.isArray(stereo) ? { input_left: stereo[0], input_right: stereo[1] } : { input: stereo }
+}
+
+const stereo_streams = (stereo: Stereo): Stream[] => {
+  return Array.isArray(stereo) ? stereo : [stereo]
+}
+
+// makes a stream hold value until a node writes to it again
+export const set_constant = (stream: Stream, value: number) => {
+  dsp_c.set_constant(stream, value)
 }
 
 export const set_block_size = (n: number) => {
@@ -37,16 +120,36 @@ export const get_block_size = () => {
 
 //// dsp scheduling //////////////////////////////
 
-const scheduled_functions: (() => void)[] = []
+// every node is added to one graph and the whole graph runs in a single call.
+// independent nodes are spread over worker threads, leaving a core for the
+// main thread and one for this one
+const worker_count = math.max(0, dsp_c.get_core_count() - 2)
+let graph = dsp_c.new_graph(worker_count)
+// patches are built into the spare graph while the current one keeps playing,
+// the two take turns with one set of workers
+let spare_graph = dsp_c.new_graph(graph)
+let building_graph = graph
+
+// nodes run in the order they are added, except that nodes which don't share
+// any streams may run at the same time. once there is a main output, nodes it
+// doesn't depend on are skipped
+const add_node = <N extends dsp_c.Node>(node: N): N => {
+  return dsp_c.graph_add(building_graph, node)
+}
 
 export const schedule = (fn: () => void) => {
-  scheduled_functions.push(fn)
+  add_node(dsp_c.new_function(fn))
 }
 
+// returns whether a limiter was hit
 const process_scheduled = () => {
-  for (let fn of scheduled_functions) {
-    fn()
+  if (native !== undefined) {
+    const hit_limiter = native.dsp_graph_process(ffi.cast('dsp_graph *', graph), current_block_size)
+    if (hit_limiter >= 0) {
+      return hit_limiter === 1
+    }
   }
+  return dsp_c.graph_process(graph, current_block_size)
 }
 
 //// steps ///////////////////////////////////////
@@ -54,245 +157,481 @@ const process_scheduled = () => {
 let step_phase = 0
 let step_duration = 0.25
 
-const step_functions: (() => void)[] = []
+let step_functions: (() => void)[] = []
 
 export const schedule_on_step = (fn: () => void) => {
   step_functions.push(fn)
 }
 
+// events queued by nodes' set functions land this many samples into the next
+// block, steps set it to their sample while their functions run so blocks
+// don't have to be split on steps. anything else a step function changes,
+// like values, applies from the start of the block
+let event_offset = 0
+
+export const get_event_offset = () => {
+  return event_offset
+}
+
 const on_step = () => {
   for (let fn of step_functions) {
     fn()
   }
 }
 
+// runs the step functions of every step that lands in the next samples
+const run_steps = (samples: number) => {
+  let offset = 0
+  while (true) {
+    const samples_until_step = math.ceil((1 - step_phase) * step_duration * sample_rate)
+    if (offset + samples_until_step >= samples) {
+      step_phase += (samples - offset) / sample_rate / step_duration
+      break
+    }
+    offset += samples_until_step
+    step_phase += samples_until_step / sample_rate / step_duration - 1
+    event_offset = offset
+    on_step()
+  }
+  event_offset = 0
+}
+
 //// output //////////////////////////////////////
 
-let main_output: [Stream, Stream]
+let main_output: Stereo | undefined
+// interleaves the main output into output_blob, returns whether it hit the
+// limiter
+let write_main_output = () => false
+// the main output can be limited as it's interleaved, which saves the
+// limiter's output streams and a separate interleave
+let main_limiter: { lookahead: number } | undefined
+// the output holds output_frames of latency at most, and blocks are rendered
+// whenever at least refill_frames of it are free. a smaller output means less
+// latency and less headroom before an underrun
 let output_frames = 2048
+let refill_frames = 512
+
+let output_sound: Sound
+let output_source: Source
+
+const open_output = () => {
+  output_sound = lovr.data.newSound(output_frames, 'f32', 'stereo', sample_rate, 'stream')
+  output_source = lovr.audio.newSource(output_sound, {
+    pitchable: false,
+    spatial: false,
+  })
+  output_source.setVolume(0.1)
+}
+
+open_output()
+
+// replaces the output, whatever was queued in the old one is dropped
+export const set_output_buffer = (frames: number, refill: number) => {
+  assert(refill > 0 && refill <= frames, 'refill frames must be between 1 and the output size')
+  output_source.stop()
+  output_frames = frames
+  refill_frames = refill
+  open_output()
+  dsp_c.reset_telemetry()
+}
+
+export const get_output_buffer = () => {
+  return { output_frames, refill_frames }
+}
 
-const output_sound = lovr.data.newSound(output_frames, 'f32', 'stereo', sample_rate, 'stream')
-const output_source = lovr.audio.newSource(output_sound, {
-  pitchable: false,
-  spatial: false,
-})
-output_source.setVolume(0.1)
+let output_blob = lovr.data.newBlob(2 * sizeof_sample * max_block_size, 'output_blob')
+let output_pointer = output_blob.getPointer()
 
-const output_blob = lovr.data.newBlob(2 * sizeof_sample * max_block_size, 'output_blob')
+export const set_max_block_size = (block_size: number) => {
+  dsp_c.set_max_block_size(block_size)
+  max_block_size = block_size
+  output_blob = lovr.data.newBlob(2 * sizeof_sample * max_block_size, 'output_blob')
+  output_pointer = output_blob.getPointer()
+}
 
 export const process_if_needed = () => {
-  // check sound
-  while (output_sound.getCapacity() >= 512) {
-    let samples_to_render = math.min (max_block_size, output_sound.getCapacity())
-    while (samples_to_render > 0) {
-      // determine block size
-      const samples_until_step = math.ceil((1 - step_phase) * step_duration * sample_rate)
-      const samples_in_segment = math.min(samples_to_render, samples_until_step)
-      // process
-      process_samples(samples_in_segment)
-      // update times
-      samples_to_render -= samples_in_segment
-      step_phase += samples_in_segment / sample_rate / step_duration
-
-      // do step if necessary
-      if (samples_until_step == samples_in_segment) {
-        step_phase -= 1
-        on_step()
-      }
-    }
+  // check sound, an empty output after it started playing means it ran dry
+  const capacity = output_sound.getCapacity()
+  const underrun = capacity >= output_frames && output_source.isPlaying()
+  dsp_c.record_fill(output_frames - capacity, output_frames, underrun)
+
+  while (output_sound.getCapacity() >= refill_frames) {
+    process_samples(math.min(max_block_size, output_sound.getCapacity()))
   }
+  build_requested_patch()
 }
 
-export const process_samples = (samples: number) => {
-  print(samples)
+// the output drains at the sample rate, so the time until it has room again
+// is known. lovr doesn't signal when that happens, so the wait is timed, and
+// is at least half a millisecond so a device that drains in bursts doesn't
+// make the loop spin. control.ts wakes it with every command, which is applied
+// straight away so a swapped patch can be built before the next block is due
+export const wait_until_needed = () => {
+  const frames_missing = refill_frames - output_sound.getCapacity()
+  if (dsp_c.wait(math.max(0.0005, frames_missing / sample_rate))) {
+    apply_commands()
+  }
+}
+
+// runs the steps and the graph and interleaves the main output into
+// output_blob, returns whether any limiter was hit
+const render_samples = (samples: number) => {
+  switch_to_staged_patch()
+  apply_commands()
+  run_steps(samples)
   // set block size
   current_block_size = samples;
   // run all nodes
-  process_scheduled()
+  const hit_limiter = process_scheduled()
   // interleave
-  dsp_c.stereo_interleave({
-    sample_count: current_block_size,
-    output_stereo: output_blob.getPointer(),
-    input_left: main_output[0],
-    input_right: main_output[1]
-  })
+  return write_main_output() || hit_limiter
+}
+
+export const process_samples = (samples: number) => {
+  const start_time = dsp_c.get_time()
+  const hit_limiter = render_samples(samples)
+  // frames that don't fit are dropped by the sound
+  const overrun = output_sound.getCapacity() < current_block_size
   output_sound.setFrames(output_blob, current_block_size)
   if (!output_source.isPlaying()) {
     output_source.play()
   }
+  dsp_c.record_render(dsp_c.get_time() - start_time, current_block_size / sample_rate, overrun, hit_limiter)
+}
+
+export const set_output = (output: Stereo) => {
+  main_output = output
+  dsp_c.graph_set_outputs(graph, stereo_streams(output))
+  write_main_output = output_writer(output)
+}
+
+// a function interleaving streams into output_blob, through the limiter if
+// there is one
+const output_writer = (output: Stereo): (() => boolean) => {
+  if (main_limiter !== undefined) {
+    const limiter = dsp_c.new_stereo_limiter({
+      output_stereo: output_pointer,
+      ...stereo_inputs(output),
+      lookahead: main_limiter.lookahead,
+    })
+    const pointer = node_pointer(limiter)
+    return () => {
+      const hit_limiter = pointer !== undefined ? native!.dsp_node_process(pointer, current_block_size) : -1
+      return hit_limiter >= 0 ? hit_limiter === 1 : dsp_c.stereo_limiter(limiter, current_block_size)
+    }
+  } else {
+    const interleave = dsp_c.new_stereo_interleave({
+      output_stereo: output_pointer,
+      ...stereo_inputs(output),
+    })
+    const pointer = node_pointer(interleave)
+    return () => {
+      if (pointer === undefined || native!.dsp_node_process(pointer, current_block_size) < 0) {
+        dsp_c.stereo_interleave(interleave, current_block_size)
+      }
+      return false
+    }
+  }
+}
+
+// limits the main output from now on, including the outputs of patches
+// swapped in later. lookahead delays it by that many samples
+export const set_output_limiter = (enabled: boolean, lookahead = 0) => {
+  main_limiter = enabled ? { lookahead } : undefined
+  if (main_output !== undefined) {
+    set_output(main_output)
+  }
+  if (staged_patch !== undefined) {
+    staged_patch.write_output = output_writer(staged_patch.output)
+  }
+}
+
+//// subgraphs /////////////////////////////////
+
+export type Rate = { oversample: number } | { decimate: number }
+
+// builds nodes into their own graph that runs at a different rate, e.g. 2x
+// oversampled saturation or modulation at 1/4 rate. build gets mono copies of
+// inputs at the inner rate and returns the streams to bring back out, it
+// shouldn't use any other streams from outside. times given in samples, like
+// delay buffer sizes, don't follow the inner rate
+export const resampled = (rate: Rate, inputs: Stream[], build: (inputs: Stream[]) => Stream[]): Stream[] => {
+  const oversample = 'oversample' in rate
+  const factor = 'oversample' in rate ? rate.oversample : rate.decimate
+  const inner_graph = dsp_c.new_graph()
+  const inner_inputs = inputs.map(() => new_stream())
+  const outer_graph = building_graph
+  building_graph = inner_graph
+  const inner_outputs = build(inner_inputs)
+  building_graph = outer_graph
+  const outputs = inner_outputs.map(() => new_stream())
+  add_node(dsp_c.new_subgraph({ graph: inner_graph, factor, oversample, inputs, inner_inputs, inner_outputs, outputs }))
+  return outputs
+}
+
+//// patches ///////////////////////////////////
+
+// a patch builds nodes and returns the main output. swapping only requests
+// the patch: once the output has been topped up, so the audio already queued
+// covers the time it takes, the patch is built into the spare graph and
+// scheduled, and the graphs switch at the start of the next block. the old
+// patch plays right up to that block. step functions belong to the patch that
+// scheduled them
+const patches = new Map<number, () => Stereo>()
+
+type StagedPatch = {
+  output: Stereo
+  write_output: () => boolean
+  step_functions: (() => void)[]
+}
+
+let requested_patch: number | undefined
+let staged_patch: StagedPatch | undefined
+// the spare graph holds the patch that played before the last switch until
+// it's cleared between blocks
+let spare_needs_clear = false
+
+export const define_patch = (id: number, build: () => Stereo) => {
+  patches.set(id, build)
+}
+
+// the main thread swaps patches with control.swap_patch(id)
+export const swap_patch = (id: number) => {
+  assert(patches.has(id), 'no patch ' + id)
+  requested_patch = id
+}
+
+// builds and schedules the requested patch, called between blocks
+const build_requested_patch = () => {
+  if (spare_needs_clear) {
+    // lets the old patch's nodes be collected
+    dsp_c.graph_clear(spare_graph)
+    spare_needs_clear = false
+  }
+  if (requested_patch === undefined || staged_patch !== undefined) {
+    return
+  }
+  const build = patches.get(requested_patch)!
+  requested_patch = undefined
+  const playing_step_functions = step_functions
+  step_functions = []
+  building_graph = spare_graph
+  const output = build()
+  building_graph = graph
+  dsp_c.graph_set_outputs(spare_graph, stereo_streams(output))
+  dsp_c.graph_schedule(spare_graph)
+  staged_patch = { output, write_output: output_writer(output), step_functions }
+  step_functions = playing_step_functions
+}
+
+// switching only swaps the graphs and what belongs to the patches
+const switch_to_staged_patch = () => {
+  if (staged_patch === undefined) {
+    return
+  }
+  const previous_graph = graph
+  graph = spare_graph
+  spare_graph = previous_graph
+  building_graph = graph
+  main_output = staged_patch.output
+  write_main_output = staged_patch.write_output
+  step_functions = staged_patch.step_functions
+  staged_patch = undefined
+  spare_needs_clear = true
+}
+
+//// commands //////////////////////////////////
+
+// the main thread reaches the audio thread through dsp_c's command queue.
+// set_value commands go straight to bound values, the rest are handled here
+// at the start of each block
+const connections = new Map<number, (value: number) => void>()
+
+// a value the main thread can set with control.set_value(id, value)
+export const parameter = (id: number, value = 0): Value => {
+  const parameter = new_value(value)
+  dsp_c.bind_value(id, parameter)
+  return parameter
 }
 
-export const set_output = (streams: [Stream, Stream]) => {
-  main_output = streams
+// input when connected and silence when not, control.connect(id) and
+// control.disconnect(id) switch it
+export const connection = (id: number, input: Stream, connected = true): Stream => {
+  const gate = control(connected ? 1 : 0)
+  connections.set(id, gate.set)
+  return multiply(input, gate.output)
+}
+
+const apply_commands = () => {
+  const commands = dsp_c.apply_commands()
+  if (commands === undefined) {
+    return
+  }
+  for (const command of commands) {
+    if (command.type === 'swap_graph') {
+      swap_patch(command.target)
+    } else {
+      const set = connections.get(command.target)
+      if (set !== undefined) {
+        set(command.type === 'connect' ? 1 : 0)
+      }
+    }
+  }
+}
+
+//// offline ///////////////////////////////////
+
+// renders seconds of the main output to a file as fast as possible instead of
+// to the audio device
+export const render_offline = (path: string, seconds: number, format: dsp_c.FileFormat = 'wav') => {
+  const writer = dsp_c.open_file_writer(path, format, 2, sample_rate)
+  let samples_to_render = math.ceil(seconds * sample_rate)
+  while (samples_to_render > 0) {
+    const samples = math.min(max_block_size, samples_to_render)
+    build_requested_patch()
+    render_samples(samples)
+    dsp_c.write_frames(writer, output_pointer, samples)
+    samples_to_render -= samples
+  }
+  return dsp_c.close_file_writer(writer)
 }
 
 //// nodes ///////////////////////////////////////
 
-export const add = (...inputs: Stream[]): Stream => {
+// a stream holding a value that changes on the sample it's set on
+export const control = (value = 0) => {
   const output = new_stream()
-  const state = { sample_count: 0, output, inputs }
-  schedule(() => {
-    state.sample_count = current_block_size
-    dsp_c.add(state)
-  })
+  const node = add_node(dsp_c.new_set({ output, value }))
+  const pointer = node_pointer(node)
+  return {
+    output,
+    set: (value: number) => {
+      if (pointer === undefined || !native!.dsp_set_value(pointer, value, event_offset)) {
+        dsp_c.set_value(node, value, event_offset)
+      }
+    },
+  }
+}
+
+// add, multiply, lowpass and highpass work on multichannel streams too, mono
+// inputs apply to every channel
+export const add = (...inputs: Stream[]): Stream => {
+  const output = new_stream_like(inputs)
+  add_node(dsp_c.new_add({ output, inputs }))
   return output
 }
 
-export const stereo_add = (...items: [Stream, Stream][]): [Stream, Stream] => {
-  return [
-    add(...items.map(x => x[0])),
-    add(...items.map(x => x[1])),
-  ]
+// one node for both channels, mono inputs are added to both
+export const stereo_add = (...inputs: Stream[]): Stream => {
+  const output = new_multichannel_stream(2)
+  add_node(dsp_c.new_add({ output, inputs }))
+  return output
 }
 
 export const multiply = (...inputs: Stream[]): Stream => {
-  const output = new_stream()
-  const state = { sample_count: 0, output, inputs }
-  schedule(() => {
-    state.sample_count = current_block_size
-    dsp_c.multiply(state)
-  })
+  const output = new_stream_like(inputs)
+  add_node(dsp_c.new_multiply({ output, inputs }))
   return output
 }
 
-export const stereo_multiply = (as: [Stream, Stream], b: Stream): [Stream, Stream] => {
-  return [
-    multiply(as[0], b),
-    multiply(as[1], b),
-  ]
+// one node for both channels, so a mono modulator is read by one call
+export const stereo_multiply = (input: Stream, gain: Stream): Stream => {
+  const output = new_multichannel_stream(2)
+  add_node(dsp_c.new_multiply({ output, inputs: [input, gain] }))
+  return output
 }
 
-export const lowpass = (input: Stream, input_cutoff: Stream) => {
-  const output = new_stream()
-  const state = { sample_count: 0, output, input, input_cutoff }
-  schedule(() => {
-    state.sample_count = current_block_size
-    dsp_c.lowpass(state)
-  })
+// by default the cutoff is read every sample, for slowly changing cutoffs
+// control_rate (e.g. 16 or 32) and approximate make filters much cheaper
+export type FilterOptions = {
+  control_rate?: number
+  approximate?: boolean
+}
+
+export const lowpass = (input: Stream, input_cutoff: Stream, options: FilterOptions = {}) => {
+  const output = new_stream_like([input])
+  add_node(dsp_c.new_lowpass({ output, input, input_cutoff, ...options }))
   return output
 }
 
-export const highpass = (input: Stream, input_cutoff: Stream) => {
-  const output = new_stream()
-  const state = { sample_count: 0, output, input, input_cutoff }
-  schedule(() => {
-    state.sample_count = current_block_size
-    dsp_c.highpass(state)
-  })
+export const highpass = (input: Stream, input_cutoff: Stream, options: FilterOptions = {}) => {
+  const output = new_stream_like([input])
+  add_node(dsp_c.new_highpass({ output, input, input_cutoff, ...options }))
   return output
 }
 
 export const triangle = (input_frequency: Stream, input_duty: Stream) => {
   const output = new_stream()
-  const state = { sample_count: 0, output, input_frequency, input_duty }
-  schedule(() => {
-    state.sample_count = current_block_size
-    dsp_c.triangle(state)
-  })
+  add_node(dsp_c.new_triangle({ output, input_frequency, input_duty }))
   return output
 }
 
+export type Shape = 'triangle' | 'saw' | 'square' | 'sine'
+
+export const oscillator_bank = (shape: Shape, inputs_frequency: Stream[], inputs_duty?: Stream[]) => {
+  const outputs = inputs_frequency.map(() => new_stream())
+  add_node(dsp_c.new_oscillator_bank({ outputs, inputs_frequency, inputs_duty, shape }))
+  return outputs
+}
+
 export const adsr = (input_gate: Stream, attack: Value, decay: Value, sustain: Value, release: Value) => {
   const output = new_stream()
-  const state = {
-    sample_count: 0,
+  add_node(dsp_c.new_adsr({ output, input_gate, attack, decay, sustain, release }))
+  return output
+}
+
+// an adsr whose gate is set from lua instead of read from a stream
+export const gated_adsr = (attack: Value, decay: Value, sustain: Value, release: Value) => {
+  const output = new_stream()
+  const node = add_node(dsp_c.new_adsr({ output, attack, decay, sustain, release }))
+  const pointer = node_pointer(node)
+  return {
     output,
-    input_gate,
-    attack: 0,
-    decay: 0,
-    sustain: 0,
-    release: 0 
+    set_gate: (gate: boolean) => {
+      if (pointer === undefined || !native!.dsp_adsr_set_gate(pointer, gate, event_offset)) {
+        dsp_c.adsr_set_gate(node, gate, event_offset)
+      }
+    },
   }
-  schedule(() => {
-    state.sample_count = current_block_size
-    state.attack = attack[0]
-    state.decay = decay[0]
-    state.sustain = sustain[0]
-    state.release = release[0]
-    dsp_c.adsr(state)
-  })
-  return output
 }
 
-export const stereo_limiter = (inputs: [Stream, Stream]) => {
-  const outputs = [new_stream(), new_stream()] as [Stream, Stream]
-  const state = {
-    sample_count: 0,
-    output_left: outputs[0],
-    output_right: outputs[1],
-    input_left: inputs[0],
-    input_right: inputs[1],
-    hit_limiter: false
+// lookahead delays the outputs by that many samples so peaks are caught
+// before they arrive. the output is a pair or a 2 channel stream like input
+export const stereo_limiter = (input: Stereo, lookahead?: number): Stereo => {
+  if (Array.isArray(input)) {
+    const outputs: [Stream, Stream] = [new_stream(), new_stream()]
+    add_node(dsp_c.new_stereo_limiter({
+      output_left: outputs[0],
+      output_right: outputs[1],
+      input_left: input[0],
+      input_right: input[1],
+      lookahead,
+    }))
+    return outputs
   }
-  schedule(() => {
-    state.sample_count = current_block_size
-    dsp_c.stereo_limiter(state)
-    if (state.hit_limiter) {
-      print('hit limiter!')
-    }
-  })
-  return outputs
+  const output = new_multichannel_stream(2)
+  add_node(dsp_c.new_stereo_limiter({ output, input, lookahead }))
+  return output
 }
 
 class DelayBuffer {
   readonly max_delay_samples: number
   readonly buffer_size: number
-  readonly buffer: Blob
-
-  private write_index = 0
-  // this offset represents delay time 0 *at the start of the buffer duration*
-  private read_index = 0
-  private wrote_this_step = true
+  readonly node: dsp_c.Node<'delay_buffer'>
 
   constructor(
     readonly buffer_time: number,
   ) {
     this.max_delay_samples = math.ceil(buffer_time * sample_rate)
-    // + block_size here so that we get the full time even when reading after writing
+    // + block_size here so that we get the full time even when reading after writing,
+    // dsp_c rounds this up to a power of two
     this.buffer_size = math.ceil(this.max_delay_samples + 1 + max_block_size)
-    this.buffer = lovr.data.newBlob(sizeof_sample * this.buffer_size)
-
-    schedule(() => this.process())
-  }
-
-  process() {
-    assert(this.wrote_this_step) // there must be a writer or else we'd play old samples
-    this.wrote_this_step = false
-    // the read index to *start* reading a stream at
-    // points to the beginning of this step's write (which has not happened yet)
-    this.read_index = this.write_index
-  }
-
-  write_stream(input: Stream) {
-    assert(!this.wrote_this_step)
-    this.wrote_this_step = true
-
-    const write_state = {
-      sample_count: current_block_size,
-      buffer: this.buffer.getPointer(),
+    // the buffer node runs before any writer or reader added after it
+    this.node = add_node(dsp_c.new_delay_buffer({
+      max_block_size,
+      max_delay_samples: this.max_delay_samples,
       buffer_size: this.buffer_size,
-      write_index: this.write_index,
-      input
-    }
-    dsp_c.delay_writer(write_state)
-    this.write_index = write_state.write_index
-  }
-
-  read_stream_into(output: Stream, input_delay_time: Stream) {
-    // this is the minimum amount a delay can be
-    const min_delay_samples = this.wrote_this_step ? 0 : max_block_size
-    const max_delay_samples = this.max_delay_samples
-    
-    dsp_c.delay_reader({
-      sample_count: current_block_size,
-      buffer: this.buffer.getPointer(),
-      buffer_size: this.buffer_size,
-      read_index: this.read_index,
-      min_delay_samples,
-      max_delay_samples,
-      output,
-      input_delay_time
-    })
+    }))
   }
 }
 
@@ -301,35 +640,62 @@ export const new_delay_buffer = (buffer_time: number) => {
 }
 
 export const delay_writer = (delay_buffer: DelayBuffer, input: Stream) => {
-  schedule(() => {
-    delay_buffer.write_stream(input)
-  })
+  add_node(dsp_c.new_delay_writer({ delay_buffer: delay_buffer.node, input }))
 }
 
-export const delay_reader = (delay_buffer: DelayBuffer, input_delay_time: Stream) => {
+// modulated delays sound smoother with 'linear' or 'cubic' interpolation
+export const delay_reader = (delay_buffer: DelayBuffer, input_delay_time: Stream, interpolation: dsp_c.Interpolation = 'none') => {
   const output = new_stream()
-  schedule(() => {
-    delay_buffer.read_stream_into(output, input_delay_time)
-  })
+  add_node(dsp_c.new_delay_reader({ delay_buffer: delay_buffer.node, output, input_delay_time, interpolation }))
   return output
 }
 
-export const white_noise = () => {
+export const white_noise = (seed?: number) => {
   const output = new_stream()
-  const state = { sample_count: 0, output }
-  schedule(() => {
-    state.sample_count = current_block_size
-    dsp_c.white_noise(state)
-  })
+  add_node(dsp_c.new_white_noise({ output, seed }))
   return output
 }
 
-export const pink_noise = () => {
+export const pink_noise = (seed?: number) => {
   const output = new_stream()
-  const state = { sample_count: 0, output }
-  schedule(() => {
-    state.sample_count = current_block_size
-    dsp_c.pink_noise(state)
-  })
+  add_node(dsp_c.new_pink_noise({ output, seed }))
   return output
 }
+
+export type VoicePoolOptions = {
+  shape?: Shape
+  // lowpass cutoff in hz
+  cutoff?: Value
+  steal?: 'oldest' | 'quietest'
+}
+
+// many voices in one node, notes are played with note_on and note_off
+export const voice_pool = (voice_count: number, attack: Value, decay: Value, sustain: Value, release: Value, options: VoicePoolOptions = {}) => {
+  const output = new_stream()
+  const node = add_node(dsp_c.new_voice_pool({ output, voice_count, attack, decay, sustain, release, ...options }))
+  const pointer = node_pointer(node)
+  return {
+    output,
+    note_on: (note: number, frequency: number, velocity = 1) => {
+      if (pointer === undefined || !native!.dsp_voice_pool_note_on(pointer, note, frequency, velocity, event_offset)) {
+        dsp_c.voice_pool_note_on(node, note, frequency, velocity, event_offset)
+      }
+    },
+    note_off: (note: number) => {
+      if (pointer === undefined || !native!.dsp_voice_pool_note_off(pointer, note, event_offset)) {
+        dsp_c.voice_pool_note_off(node, note, event_offset)
+      }
+    },
+    active_count: () => dsp_c.voice_pool_active_count(node),
+  }
+}
+
+// convolves input with each impulse response, a path to a 32 bit float wav or
+// raw file or an array of samples. the impulse responses share the transforms
+// of the input, so several reverb sends of one bus cost little more than one.
+// the outputs are partition_size samples late
+export const convolution = (input: Stream, impulse_responses: (string | number[])[], partition_size?: number): Stream[] => {
+  const outputs = impulse_responses.map(() => new_stream())
+  add_node(dsp_c.new_convolver({ input, outputs, impulse_responses, partition_size }))
+  return outputs
+}
@@ -6,16 +6,31 @@ const start = () => {
   while (true) {
     dsp.process_if_needed()
     collectgarbage('step', 0)
-    lovr.timer.sleep(0.001)
+    dsp.wait_until_needed()
   }
 }
 
 //// construct audio graph ///////////////////////
 
-const tri = dsp.triangle(dsp.new_stream(220), dsp.new_stream(0.5))
-const lim = dsp.stereo_limiter([tri, tri])
+// the main thread switches between these with control.swap_patch(id)
+const single_patch = (): [dsp.Stream, dsp.Stream] => {
+  const tri = dsp.triangle(dsp.new_stream(220), dsp.new_stream(0.5))
+  return [tri, tri]
+}
+
+// a 2 channel output goes to the limiter as it is
+const fifth_patch = (): dsp.Stereo => {
+  const root = dsp.triangle(dsp.new_stream(220), dsp.new_stream(0.5))
+  const fifth = dsp.triangle(dsp.new_stream(330), dsp.new_stream(0.5))
+  return dsp.stereo_add(root, fifth)
+}
+
+dsp.define_patch(1, single_patch)
+dsp.define_patch(2, fifth_patch)
 
-dsp.set_output(lim)
+dsp.set_output_limiter(true)
+// the first patch goes straight into the playing graph
+dsp.set_output(single_patch())
 
 //// start ///////////////////////////////////////
 
@@ -0,0 +1,370 @@
+// standalone benchmark for the dsp_c nodes, without lovr or an audio device.
+// every case builds its nodes through the same lua constructors the module
+// uses, then calls their process functions directly so the timings are just
+// the kernels. inputs are either constant streams, modulated streams, or
+// modulated controls with subnormal signals to catch denormal stalls
+//
+// usage: dsp_bench [min_milliseconds] [case...]
+// prints csv to stdout, run with DSP_KERNELS=scalar to compare against the
+// scalar kernels
+//
+// dsp_bench --check instead runs the convolver and the subgraph resamplers
+// against straightforward references, prints csv and exits with 1 if any is
+// off by more than its tolerance
+
+#include "dsp_c.c"
+
+#include <stdio.h>
+#include <lualib.h>
+
+typedef struct {
+  const char *name;
+  // lua returning the list of nodes to run, in order
+  const char *source;
+} BenchCase;
+
+static const BenchCase bench_cases[] = {
+  { "set", "return { dsp_c.new_set({ output = dsp_c.new_stream(), value = 0.5 }) }" },
+  { "add", "return { dsp_c.new_add({ output = dsp_c.new_stream(), inputs = { a, b, a, b } }) }" },
+  { "multiply", "return { dsp_c.new_multiply({ output = dsp_c.new_stream(), inputs = { a, b, a, b } }) }" },
+  { "lowpass", "return { dsp_c.new_lowpass({ output = dsp_c.new_stream(), input = a, input_cutoff = cutoff }) }" },
+  { "highpass", "return { dsp_c.new_highpass({ output = dsp_c.new_stream(), input = a, input_cutoff = cutoff }) }" },
+  { "lowpass_control_rate", "return { dsp_c.new_lowpass({ output = dsp_c.new_stream(), input = a, input_cutoff = cutoff, control_rate = 32, approximate = true }) }" },
+  { "triangle", "return { dsp_c.new_triangle({ output = dsp_c.new_stream(), input_frequency = frequency, input_duty = duty }) }" },
+  { "oscillator_bank_sine_8",
+    "local outputs, frequencies = {}, {}\n"
+    "for i = 1, 8 do outputs[i] = dsp_c.new_stream() frequencies[i] = frequency end\n"
+    "return { dsp_c.new_oscillator_bank({ outputs = outputs, inputs_frequency = frequencies, shape = 'sine' }) }" },
+  { "adsr",
+    "return { dsp_c.new_adsr({ output = dsp_c.new_stream(), input_gate = gate,\n"
+    "  attack = dsp_c.new_value(0.01), decay = dsp_c.new_value(0.1), sustain = dsp_c.new_value(0.5), release = dsp_c.new_value(0.2) }) }" },
+  { "stereo_limiter", "return { dsp_c.new_stereo_limiter({ output_left = dsp_c.new_stream(), output_right = dsp_c.new_stream(), input_left = a, input_right = b }) }" },
+  { "stereo_interleave", "return { dsp_c.new_stereo_interleave({ output_stereo = stereo_output, input_left = a, input_right = b }) }" },
+  { "delay", NULL },
+  { "delay_linear", NULL },
+  { "delay_cubic", NULL },
+  { "white_noise", "return { dsp_c.new_white_noise({ output = dsp_c.new_stream() }) }" },
+  { "pink_noise", "return { dsp_c.new_pink_noise({ output = dsp_c.new_stream() }) }" },
+  { NULL, NULL },
+};
+
+// the delay cases share their source, with the interpolation as a global
+static const char *delay_source =
+  "local buffer = dsp_c.new_delay_buffer({ max_block_size = 2048, max_delay_samples = 4410, buffer_size = 4410 + 1 + 2048 })\n"
+  "return {\n"
+  "  buffer,\n"
+  "  dsp_c.new_delay_writer({ delay_buffer = buffer, input = a }),\n"
+  "  dsp_c.new_delay_reader({ delay_buffer = buffer, output = dsp_c.new_stream(), input_delay_time = delay_time, interpolation = interpolation }),\n"
+  "}";
+
+enum {
+  MODE_CONSTANT,
+  MODE_MODULATED,
+  MODE_DENORMAL,
+};
+
+static const char *const mode_names[] = { "constant", "modulated", "denormal" };
+
+static const int block_sizes[] = { 32, 64, 128, 256, 512, 1024, 2048 };
+
+#define MAX_BENCH_NODES 16
+
+static float stereo_output[2 * MAX_BLOCK_SIZE];
+
+// sets a global stream ranging between low and high, constant streams sit in
+// the middle. signals are scaled into subnormals in denormal mode
+static void set_input(lua_State *L, const char *name, int mode, float low, float high, bool signal) {
+  if (mode == MODE_CONSTANT) {
+    lua_pushcfunction(L, l_new_constant);
+    lua_pushnumber(L, (low + high) / 2);
+    lua_call(L, 1, 1);
+  } else {
+    lua_pushcfunction(L, l_new_stream);
+    lua_call(L, 0, 1);
+    Stream *stream = lua_touserdata(L, -1);
+    float scale = mode == MODE_DENORMAL && signal ? 1e-39f : 1.f;
+    for (int s = 0; s < engine_block_size; s++) {
+      float t = 0.5f + 0.5f * sinf(s * 0.05f);
+      stream->samples[s] = (low + (high - low) * t) * scale;
+    }
+  }
+  lua_setglobal(L, name);
+}
+
+static void set_inputs(lua_State *L, int mode) {
+  set_input(L, "a", mode, -1, 1, true);
+  set_input(L, "b", mode, -0.5f, 1.5f, true);
+  set_input(L, "cutoff", mode, 200, 5000, false);
+  set_input(L, "frequency", mode, 110, 880, false);
+  set_input(L, "duty", mode, 0.2f, 0.8f, false);
+  set_input(L, "gate", mode, 0, 1, false);
+  set_input(L, "delay_time", mode, 0.01f, 0.09f, false);
+}
+
+// returns nanoseconds per sample for running the nodes over and over
+static double time_nodes(Node **nodes, int node_count, int sample_count, double min_seconds) {
+  Block block = { NULL, sample_count, .sample_rate = engine_sample_rate };
+  for (int warmup = 0; warmup < 16; warmup++) {
+    for (int i = 0; i < node_count; i++) {
+      nodes[i]->process(nodes[i], &block);
+    }
+  }
+  uint64_t start = get_nanoseconds();
+  uint64_t elapsed = 0;
+  long long blocks = 0;
+  while (elapsed < min_seconds * 1e9) {
+    for (int i = 0; i < node_count; i++) {
+      nodes[i]->process(nodes[i], &block);
+    }
+    blocks++;
+    elapsed = get_nanoseconds() - start;
+  }
+  return (double) elapsed / (blocks * sample_count);
+}
+
+// checks
+
+#define CHECK_SAMPLES 20000
+#define CHECK_IMPULSE_LENGTH 1000
+// the partition_size the convolver case asks for
+#define CHECK_PARTITION_SIZE 64
+
+static float check_input[CHECK_SAMPLES];
+static float check_output[CHECK_SAMPLES];
+static float check_impulse[CHECK_IMPULSE_LENGTH];
+
+// uneven so partitions and resampler phases straddle blocks
+static const int check_block_sizes[] = { 37, 512, 100, 1, 64, 200, 333 };
+#define CHECK_BLOCK_COUNT (int) (sizeof(check_block_sizes) / sizeof(*check_block_sizes))
+
+// noise that stops partway, so the convolver's tail is checked too. then
+// bursts shorter than a partition, each after a silence longer than the
+// impulse response so the convolver has gone idle. each ends a block that
+// doesn't finish its partition, so the blocks after it are silent while the
+// burst is still waiting to be transformed
+static void fill_convolver_input(void) {
+  srand(1);
+  for (int i = 0; i < CHECK_IMPULSE_LENGTH; i++) {
+    check_impulse[i] = (rand() / (float) RAND_MAX * 2 - 1) * expf(-i / 300.f);
+  }
+  for (int s = 0; s < CHECK_SAMPLES; s++) {
+    check_input[s] = s < CHECK_SAMPLES / 4 ? rand() / (float) RAND_MAX * 2 - 1 : 0;
+  }
+  int last_burst = CHECK_SAMPLES / 4;
+  for (int end = 0, b = 0; end < CHECK_SAMPLES - CHECK_IMPULSE_LENGTH; b = (b + 1) % CHECK_BLOCK_COUNT) {
+    end += check_block_sizes[b];
+    if (end - last_burst > 2 * CHECK_IMPULSE_LENGTH && end % CHECK_PARTITION_SIZE >= 4) {
+      for (int s = end - 4; s < end; s++) {
+        check_input[s] = 1;
+      }
+      last_burst = end;
+    }
+  }
+}
+
+// direct convolution, a partition late
+static double convolver_error(int *delay) {
+  *delay = CHECK_PARTITION_SIZE;
+  double error = 0;
+  for (int s = *delay; s < CHECK_SAMPLES; s++) {
+    double expected = 0;
+    for (int i = 0; i < CHECK_IMPULSE_LENGTH && i <= s - *delay; i++) {
+      expected += check_impulse[i] * check_input[s - *delay - i];
+    }
+    error = fmax(error, fabs(expected - check_output[s]));
+  }
+  return error;
+}
+
+// well under the slow rate's nyquist at every factor checked
+static void fill_round_trip_input(void) {
+  for (int s = 0; s < CHECK_SAMPLES; s++) {
+    float t = (float) s / engine_sample_rate;
+    check_input[s] = 0.4f * sinf(2 * PI * 440 * t) + 0.4f * sinf(2 * PI * 1500 * t);
+  }
+}
+
+// the input at whichever delay fits best, leaving out the start while the
+// filters fill
+static double round_trip_error(int *delay) {
+  double best = INFINITY;
+  for (int d = 0; d <= 64; d++) {
+    double error = 0;
+    for (int s = 1000; s < CHECK_SAMPLES; s++) {
+      error = fmax(error, fabs(check_output[s] - check_input[s - d]));
+    }
+    if (error < best) {
+      best = error;
+      *delay = d;
+    }
+  }
+  return best;
+}
+
+typedef struct {
+  const char *name;
+  // lua returning one node reading the global stream input and writing output
+  const char *source;
+  void (*fill)(void);
+  double (*error)(int *delay);
+  double tolerance;
+} CheckCase;
+
+// the subgraphs run an empty graph, so only the resamplers are checked
+static const CheckCase check_cases[] = {
+  { "convolver",
+    "return dsp_c.new_convolver({ input = input, outputs = { output }, impulse_responses = { impulse_response }, partition_size = 64 })",
+    fill_convolver_input, convolver_error, 1e-4 },
+  { "subgraph_oversample_2",
+    "local inner = dsp_c.new_stream()\n"
+    "return dsp_c.new_subgraph({ graph = dsp_c.new_graph(), factor = 2, oversample = true,\n"
+    "  inputs = { input }, inner_inputs = { inner }, inner_outputs = { inner }, outputs = { output } })",
+    fill_round_trip_input, round_trip_error, 1e-3 },
+  { "subgraph_decimate_2",
+    "local inner = dsp_c.new_stream()\n"
+    "return dsp_c.new_subgraph({ graph = dsp_c.new_graph(), factor = 2,\n"
+    "  inputs = { input }, inner_inputs = { inner }, inner_outputs = { inner }, outputs = { output } })",
+    fill_round_trip_input, round_trip_error, 1e-3 },
+  { NULL, NULL, NULL, NULL, 0 },
+};
+
+// runs the node over check_input into check_output
+static void run_check(Node *node, Stream *input, Stream *output) {
+  float scratch[MAX_BLOCK_SIZE];
+  for (int position = 0, b = 0; position < CHECK_SAMPLES; b = (b + 1) % CHECK_BLOCK_COUNT) {
+    int sample_count = mini(check_block_sizes[b], CHECK_SAMPLES - position);
+    // silent blocks are marked like idle nodes mark them, so the paths for
+    // silent input are checked too
+    const float *samples = check_input + position;
+    if (kernels.peak(samples, samples, sample_count) == 0) {
+      write_constant(input, 0);
+    } else {
+      memcpy(write_stream(input), samples, sample_count * sizeof(float));
+    }
+    Block block = { NULL, sample_count, .sample_rate = engine_sample_rate };
+    node->process(node, &block);
+    memcpy(check_output + position, read_stream(output, scratch, sample_count), sample_count * sizeof(float));
+    position += sample_count;
+  }
+}
+
+static Stream *set_check_stream(lua_State *L, const char *name) {
+  lua_pushcfunction(L, l_new_stream);
+  lua_call(L, 0, 1);
+  Stream *stream = lua_touserdata(L, -1);
+  lua_setglobal(L, name);
+  return stream;
+}
+
+static int run_checks(lua_State *L) {
+  printf("check,delay,max_error,tolerance,result\n");
+  bool passed = true;
+  for (const CheckCase *check_case = check_cases; check_case->name; check_case++) {
+    check_case->fill();
+    lua_createtable(L, CHECK_IMPULSE_LENGTH, 0);
+    for (int i = 0; i < CHECK_IMPULSE_LENGTH; i++) {
+      lua_pushnumber(L, check_impulse[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_setglobal(L, "impulse_response");
+    Stream *input = set_check_stream(L, "input");
+    Stream *output = set_check_stream(L, "output");
+    if (luaL_dostring(L, check_case->source) != 0) {
+      fprintf(stderr, "%s: %s\n", check_case->name, lua_tostring(L, -1));
+      return 1;
+    }
+    run_check(check_node(L, -1), input, output);
+    lua_pop(L, 1);
+
+    int delay = 0;
+    double error = check_case->error(&delay);
+    bool pass = error <= check_case->tolerance;
+    printf("%s,%d,%g,%g,%s\n", check_case->name, delay, error, check_case->tolerance, pass ? "pass" : "fail");
+    fflush(stdout);
+    passed &= pass;
+  }
+  return passed ? 0 : 1;
+}
+
+static bool selected(int argc, char **argv, int first_name, const char *name) {
+  if (first_name >= argc) {
+    return true;
+  }
+  for (int i = first_name; i < argc; i++) {
+    if (strcmp(argv[i], name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  double min_seconds = 0.02;
+  int first_name = 1;
+  if (argc > 1 && atof(argv[1]) > 0) {
+    min_seconds = atof(argv[1]) / 1000;
+    first_name = 2;
+  }
+
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  lua_pushcfunction(L, luaopen_dsp_c);
+  lua_call(L, 0, 1);
+  lua_setglobal(L, "dsp_c");
+  // like the audio thread does, denormal mode shows anything that still stalls
+  flush_denormals_on_this_thread();
+  // room for the longest block in block_sizes
+  engine_block_size = MAX_BLOCK_SIZE;
+  lua_pushlightuserdata(L, stereo_output);
+  lua_setglobal(L, "stereo_output");
+
+  if (argc > 1 && strcmp(argv[1], "--check") == 0) {
+    int status = run_checks(L);
+    lua_close(L);
+    return status;
+  }
+
+  printf("kernel_set,node,mode,block_size,ns_per_sample,voices_per_core\n");
+  for (const BenchCase *bench_case = bench_cases; bench_case->name; bench_case++) {
+    if (!selected(argc, argv, first_name, bench_case->name)) {
+      continue;
+    }
+    const char *source = bench_case->source ? bench_case->source : delay_source;
+    const char *interpolation = strcmp(bench_case->name, "delay_linear") == 0 ? "linear"
+      : strcmp(bench_case->name, "delay_cubic") == 0 ? "cubic" : "none";
+    lua_pushstring(L, interpolation);
+    lua_setglobal(L, "interpolation");
+
+    for (int mode = MODE_CONSTANT; mode <= MODE_DENORMAL; mode++) {
+      set_inputs(L, mode);
+      if (luaL_dostring(L, source) != 0) {
+        fprintf(stderr, "%s: %s\n", bench_case->name, lua_tostring(L, -1));
+        return 1;
+      }
+      int node_count = lua_objlen(L, -1);
+      if (node_count > MAX_BENCH_NODES) {
+        fprintf(stderr, "%s: too many nodes\n", bench_case->name);
+        return 1;
+      }
+      Node *nodes[MAX_BENCH_NODES];
+      for (int i = 0; i < node_count; i++) {
+        lua_rawgeti(L, -1, i + 1);
+        nodes[i] = check_node(L, -1);
+        lua_pop(L, 1);
+      }
+
+      for (size_t b = 0; b < sizeof(block_sizes) / sizeof(*block_sizes); b++) {
+        double ns_per_sample = time_nodes(nodes, node_count, block_sizes[b], min_seconds);
+        printf("%s,%s,%s,%d,%.3f,%.1f\n", kernel_set, bench_case->name, mode_names[mode], block_sizes[b],
+          ns_per_sample, 1e9 / (ns_per_sample * engine_sample_rate));
+        fflush(stdout);
+      }
+      // the nodes stay referenced until here
+      lua_pop(L, 1);
+      lua_gc(L, LUA_GCCOLLECT, 0);
+    }
+  }
+
+  lua_close(L);
+  return 0;
+}
@@ -3,18 +3,106 @@
 #include <lauxlib.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#define DSP_THREADS
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#define DSP_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DSP_NEON
+#endif
+
+#include "dsp_ffi.h"
 #include "xoroshiro128plus.h"
 
+// the few counters shared between threads outside of worker pools, msvc has
+// no stdatomic.h so windows uses interlocked functions
+#ifdef _WIN32
+typedef volatile LONG shared_int;
+#define SHARED_LOAD(x) InterlockedCompareExchange(&(x), 0, 0)
+#define SHARED_STORE(x, v) InterlockedExchange(&(x), (v))
+#define SHARED_INCREMENT(x) InterlockedIncrement(&(x))
+#define SHARED_FENCE() MemoryBarrier()
+#else
+typedef atomic_int shared_int;
+#define SHARED_LOAD(x) atomic_load_explicit(&(x), memory_order_acquire)
+#define SHARED_STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_release)
+#define SHARED_INCREMENT(x) (atomic_fetch_add(&(x), 1) + 1)
+#define SHARED_FENCE() atomic_thread_fence(memory_order_seq_cst)
+#endif
+
+// streams are full userdata pointing at an aligned buffer of samples. when
+// constant is set the stream holds value for the whole block and samples
+// must not be read, constant streams made by dsp_c.new_constant have no
+// buffer at all
+//
+// samples usually points at the stream's own buffer, but graphs point the
+// streams that only live within a block at shared slots of an arena instead
+//
+// a stream can have several channels, stored planar one block after another.
+// a constant stream holds the same value on every channel, and nodes that
+// take multichannel inputs use a mono input for every channel
+
+#define STREAM_TYPE "dsp_c.stream"
+#define STREAM_ALIGNMENT 32
+
+typedef struct {
+  float *samples;
+  bool constant;
+  float value;
+  float *buffer;
+  int channel_count;
+  // how many nodes use the stream, graphs only move streams that are used
+  // by nothing outside the graph
+  int access_count;
+  // set once the buffer pointer has escaped, the stream then keeps it
+  bool pinned;
+  // scratch space for graphs while they're scheduled
+  int schedule_index;
+} Stream;
+
 // lua util
 
+// accepts a stream or a lightuserdata pointing at samples
 static void *check_pointer(lua_State *L, int n){
-  if (!lua_islightuserdata(L, n)) {
-    lua_pushstring(L, "expected lightuserdata");
-    lua_error(L);
+  if (lua_islightuserdata(L, n)) {
+    return lua_touserdata(L, n);
+  }
+  Stream *stream = lua_touserdata(L, n);
+  if (stream && lua_getmetatable(L, n)) {
+    luaL_getmetatable(L, STREAM_TYPE);
+    bool is_stream = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (is_stream) {
+      stream->pinned = true;
+      return stream->samples;
+    }
   }
-  return lua_touserdata(L, n);
+  lua_pushstring(L, "expected stream or lightuserdata");
+  lua_error(L);
+  return NULL;
 }
 
 static void *check_pointer_field(lua_State *L, int n, const char *name) {
@@ -24,10 +112,9 @@ static void *check_pointer_field(lua_State *L, int n, const char *name) {
   return ptr;
 }
 
-static void *check_pointer_index(lua_State *L, int n, int index) {
-  lua_pushinteger(L, index);
-  lua_gettable(L, n);
-  void *ptr = check_pointer(L, -1);
+static void *check_udata_field(lua_State *L, int n, const char *name, const char *type) {
+  lua_getfield(L, n, name);
+  void *ptr = luaL_checkudata(L, -1, type);
   lua_pop(L, 1);
   return ptr;
 }
@@ -60,380 +147,5328 @@ static int opt_integer_field(lua_State *L, int n, const char *name, int default_
   return integer;
 }
 
-static void set_number_field(lua_State *L, int n, const char *name, double number) {
-  lua_pushnumber(L, number);
-  lua_setfield(L, n, name);
+static bool opt_bool_field(lua_State *L, int n, const char *name, bool default_bool) {
+  lua_getfield(L, n, name);
+  bool value = lua_isnoneornil(L, -1) ? default_bool : lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return value;
+}
+
+static bool has_field(lua_State *L, int n, const char *name) {
+  lua_getfield(L, n, name);
+  bool has = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  return has;
 }
 
-static void set_integer_field(lua_State *L, int n, const char *name, int integer) {
-  lua_pushnumber(L, integer);
-  lua_setfield(L, n, name);
+// nodes
+//
+// every kernel is a node: a full userdata starting with a Node header, followed
+// by the pointers and state it needs. dsp_c.new_<kind>(state) reads the state
+// table once, after which dsp_c.<kind>(node, sample_count) runs a block and the
+// state stays in c. the state table is kept as the node's environment so
+// anything the node points to stays alive
+
+typedef struct Node Node;
+
+typedef struct {
+  lua_State *L;
+  int sample_count;
+  bool hit_limiter;
+  // time each node while running the graph
+  bool profile;
+  // the rate the block runs at, which differs from the engine's inside
+  // resampled subgraphs
+  double sample_rate;
+} Block;
+
+typedef void (*NodeProcess)(Node *node, Block *block);
+
+typedef struct {
+  const char *name;
+  Node *(*create)(lua_State *L, int n);
+  void (*destroy)(lua_State *L, Node *node);
+  // barrier nodes may touch anything, so graphs run them alone on the thread
+  // that called graph_process
+  bool barrier;
+} NodeKind;
+
+// a stream, buffer or pointer that a node reads or writes
+typedef struct {
+  const void *resource;
+  bool write;
+  bool stream;
+} Access;
+
+struct Node {
+  NodeProcess process;
+  const NodeKind *kind;
+  // recorded while the node is created so graphs can tell which nodes depend
+  // on each other
+  Access *accesses;
+  int access_count;
+  // identifies the node in profiles, which are read by other lua states
+  int id;
+  uint64_t profile_nanoseconds;
+};
+
+#define NODE_TYPE "dsp_c.node"
+
+static shared_int next_node_id = 0;
+
+// pushes the new node. the metatable is set right away so the accesses are
+// freed even if creating the node fails partway through
+static void *new_node(lua_State *L, size_t size, NodeProcess process) {
+  Node *node = lua_newuserdata(L, size);
+  memset(node, 0, size);
+  node->process = process;
+  node->id = SHARED_INCREMENT(next_node_id);
+  luaL_getmetatable(L, NODE_TYPE);
+  lua_setmetatable(L, -2);
+  return node;
 }
 
-static void set_bool_field(lua_State *L, int n, const char *name, bool value) {
-  lua_pushboolean(L, value);
-  lua_setfield(L, n, name);
+static void node_access(lua_State *L, Node *node, const void *resource, bool write) {
+  Access *accesses = realloc(node->accesses, (node->access_count + 1) * sizeof(Access));
+  if (!accesses) {
+    luaL_error(L, "out of memory");
+  }
+  accesses[node->access_count++] = (Access) { resource, write, false };
+  node->accesses = accesses;
 }
 
-// dsp
+static void node_stream_access(lua_State *L, Node *node, Stream *stream, bool write) {
+  node_access(L, node, stream, write);
+  node->accesses[node->access_count - 1].stream = true;
+  stream->access_count++;
+}
 
-#define SAMPLE_RATE 44100.0
+static Node *check_node(lua_State *L, int n) {
+  return luaL_checkudata(L, n, NODE_TYPE);
+}
 
-static int l_get_sample_rate(lua_State *L) {
-  lua_pushnumber(L, SAMPLE_RATE);
+static Node *check_node_field(lua_State *L, int n, const char *name) {
+  lua_getfield(L, n, name);
+  Node *node = check_node(L, -1);
+  lua_pop(L, 1);
+  return node;
+}
+
+// values
+//
+// a value is a single number shared between lua and the nodes that read it.
+// value[1] reads and writes it, so from typescript it looks like a [number]
+
+#define VALUE_TYPE "dsp_c.value"
+
+typedef struct {
+  double value;
+} Value;
+
+static int l_new_value(lua_State *L) {
+  Value *value = lua_newuserdata(L, sizeof(Value));
+  value->value = luaL_optnumber(L, 1, 0);
+  luaL_getmetatable(L, VALUE_TYPE);
+  lua_setmetatable(L, -2);
   return 1;
 }
 
-static int l_set(lua_State *L){
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
-  float value = check_number_field(L, 1, "value");
-  for (int s = 0; s < sample_count; s++) {
-    output[s] = value;
+static int l_value_index(lua_State *L) {
+  Value *value = luaL_checkudata(L, 1, VALUE_TYPE);
+  if (luaL_checkinteger(L, 2) != 1) {
+    return luaL_error(L, "values only have index 1");
   }
-  return 0;
+  lua_pushnumber(L, value->value);
+  return 1;
 }
 
-static int l_add(lua_State *L){
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
-  memset(output, 0, sample_count * sizeof(float));
-  lua_getfield(L, 1, "inputs");
-  int len = lua_objlen(L, -1);
-  for (int i = 1; i <= len; i++) {
-    float *input = check_pointer_index(L, -1, i);
-    for (int s = 0; s < sample_count; s++) {
-      output[s] += input[s];
-    }
+static int l_value_newindex(lua_State *L) {
+  Value *value = luaL_checkudata(L, 1, VALUE_TYPE);
+  if (luaL_checkinteger(L, 2) != 1) {
+    return luaL_error(L, "values only have index 1");
   }
+  value->value = luaL_checknumber(L, 3);
   return 0;
 }
 
-static int l_multiply(lua_State *L){
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
-  for (int s = 0; s < sample_count; s++) {
-    output[s] = 1;
+// events
+//
+// lua queues events for a node at a sample offset from the start of the next
+// block the node runs, and the node applies them on that sample, so blocks
+// don't have to be split for changes to land on time. events past the end of
+// a block move on to the next one. what the fields mean depends on the node
+
+#define EVENT_QUEUE_SIZE 64
+
+typedef struct {
+  int offset;
+  int type;
+  int note;
+  float value;
+  float velocity;
+} Event;
+
+typedef struct {
+  int count;
+  Event events[EVENT_QUEUE_SIZE];
+} EventQueue;
+
+// queues an event at offset, after any events already at that offset so
+// they apply in the order they were queued. returns NULL when the queue is
+// full
+static Event *queue_event(EventQueue *queue, int offset) {
+  if (queue->count == EVENT_QUEUE_SIZE) {
+    return NULL;
   }
-  lua_getfield(L, 1, "inputs");
-  int len = lua_objlen(L, -1);
-  for (int i = 1; i <= len; i++) {
-    float *input = check_pointer_index(L, -1, i);
-    for (int s = 0; s < sample_count; s++) {
-      output[s] *= input[s];
-    }
+  int i = queue->count++;
+  while (i > 0 && queue->events[i - 1].offset > offset) {
+    queue->events[i] = queue->events[i - 1];
+    i--;
   }
-  return 0;
+  Event *event = &queue->events[i];
+  *event = (Event) { .offset = offset };
+  return event;
 }
 
-static double min(double a, double b) {
-  return a < b ? a : b;
+static Event *push_event(lua_State *L, EventQueue *queue, int n) {
+  int offset = luaL_optinteger(L, n, 0);
+  luaL_argcheck(L, offset >= 0, n, "offset can't be negative");
+  Event *event = queue_event(queue, offset);
+  if (!event) {
+    luaL_error(L, "too many events queued");
+  }
+  return event;
 }
 
-static double max(double a, double b) {
-  return a > b ? a : b;
+// whether any event lands within the next sample_count samples
+static bool has_events(const EventQueue *queue, int sample_count) {
+  return queue->count > 0 && queue->events[0].offset < sample_count;
 }
 
-static float minf(float a, float b) {
-  return a < b ? a : b;
+// where the run of samples starting before event e ends
+static int event_run_end(const EventQueue *queue, int e, int sample_count) {
+  if (e < queue->count && queue->events[e].offset < sample_count) {
+    return queue->events[e].offset;
+  }
+  return sample_count;
 }
 
-static float maxf(float a, float b) {
-  return a > b ? a : b;
+// drops the applied events and moves the rest into the next block
+static void finish_events(EventQueue *queue, int applied, int sample_count) {
+  queue->count -= applied;
+  memmove(queue->events, queue->events + applied, queue->count * sizeof(Event));
+  for (int e = 0; e < queue->count; e++) {
+    queue->events[e].offset -= sample_count;
+  }
 }
 
-static int mini(int a, int b) {
-  return a < b ? a : b;
+// simd
+//
+// the simple kernels have a scalar version that the compiler can vectorize
+// and hand written versions for avx2 and neon. select_kernels picks the best
+// one the cpu supports when the module is loaded. loads and stores are
+// unaligned since sample pointers can come from lovr blobs, but streams are
+// allocated on STREAM_ALIGNMENT so they never split cache lines
+
+// inputs are summed in chunks so each chunk of the output is written once no
+// matter how many inputs there are
+#define MIX_CHUNK 32
+
+// noise is generated by independent xoroshiro128+ lanes side by side, one
+// sample per lane per step, so a whole step fits in simd registers. every
+// step advances all lanes even when the block ends partway through, so the
+// output is the same for every kernel set
+#define NOISE_LANES 8
+
+typedef struct {
+  uint64_t s0[NOISE_LANES];
+  uint64_t s1[NOISE_LANES];
+} NoiseState;
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
 }
 
-static int maxi(int a, int b) {
-  return a > b ? a : b;
+// top 23 bits become the mantissa of a float in [2, 4), shifted to [-1, 1)
+static inline float noise_float(uint64_t x) {
+  union { uint32_t i; float f; } bits = { (uint32_t) (x >> 41) | 0x40000000 };
+  return bits.f - 3.0f;
 }
 
-#define PI 3.14159265358979323846
+// the elementwise scalar kernels, and the simd mixes and scale, are written
+// as loops that are always inlined, and get a copy with a fixed trip count
+// for each common block size so the compiler can unroll and vectorize them
+// without a remainder. other sizes, like the pieces blocks are split into at
+// steps, use the general copy
+#ifdef _MSC_VER
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#endif
 
-static float calculate_filter_coefficient(float cutoff_frequency) {
-  float wc = 2 * PI * maxf(0, minf(0.5, cutoff_frequency / SAMPLE_RATE));
-  float y = 1 - cosf(wc);
-  return -y + sqrtf(y * (y + 2));
+#define SPECIALIZE_BLOCK_SIZE(sample_count, loop) \
+  switch (sample_count) { \
+    case 32: loop(32); break; \
+    case 64: loop(64); break; \
+    case 128: loop(128); break; \
+    case 256: loop(256); break; \
+    case 512: loop(512); break; \
+    default: loop(sample_count); break; \
+  }
+
+typedef struct {
+  void (*fill)(float *restrict output, float value, int sample_count);
+  // output[s] = initial + inputs[0][s] + inputs[1][s] + ...
+  void (*accumulate)(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count);
+  // output[s] = initial * inputs[0][s] * inputs[1][s] * ...
+  void (*product)(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count);
+  void (*interleave)(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, int sample_count);
+  // output[s] = max(abs(left[s]), abs(right[s]))
+  void (*amplitude)(float *restrict output, const float *restrict input_left, const float *restrict input_right, int sample_count);
+  // output[s] = input[s] * gain[s]
+  void (*scale)(float *restrict output, const float *restrict input, const float *restrict gain, int sample_count);
+  // output_stereo[s * 2] = left[s] * gain[s], output_stereo[s * 2 + 1] = right[s] * gain[s]
+  void (*scale_interleave)(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, const float *restrict gain, int sample_count);
+  // returns the largest abs(left[s]) or abs(right[s])
+  float (*peak)(const float *restrict input_left, const float *restrict input_right, int sample_count);
+  // output[s] = uniform noise in [-1, 1)
+  void (*noise)(float *restrict output, NoiseState *restrict state, int sample_count);
+} Kernels;
+
+static FORCE_INLINE void fill_loop(float *restrict output, float value, int sample_count) {
+  for (int s = 0; s < sample_count; s++) {
+    output[s] = value;
+  }
+}
+
+static void fill_scalar(float *restrict output, float value, int sample_count) {
+#define FILL_LOOP(n) fill_loop(output, value, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, FILL_LOOP);
+#undef FILL_LOOP
+}
+
+// one chunk of at most MIX_CHUNK samples from start, a whole input at a time
+// so the samples don't wait on each other. the simd mixes use it for the
+// chunk left over at the end
+static FORCE_INLINE void accumulate_chunk(float *restrict output, float *const *inputs, int input_count, float initial, int start, int count) {
+  float sum[MIX_CHUNK];
+  for (int s = 0; s < MIX_CHUNK; s++) {
+    sum[s] = initial;
+  }
+  for (int i = 0; i < input_count; i++) {
+    const float *restrict input = inputs[i] + start;
+    for (int s = 0; s < count; s++) {
+      sum[s] += input[s];
+    }
+  }
+  memcpy(output + start, sum, count * sizeof(float));
+}
+
+static FORCE_INLINE void product_chunk(float *restrict output, float *const *inputs, int input_count, float initial, int start, int count) {
+  float product[MIX_CHUNK];
+  for (int s = 0; s < MIX_CHUNK; s++) {
+    product[s] = initial;
+  }
+  for (int i = 0; i < input_count; i++) {
+    const float *restrict input = inputs[i] + start;
+    for (int s = 0; s < count; s++) {
+      product[s] *= input[s];
+    }
+  }
+  memcpy(output + start, product, count * sizeof(float));
 }
 
-static int l_lowpass(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
-  float *input = check_pointer_field(L, 1, "input");
-  float *input_cutoff = check_pointer_field(L, 1, "input_cutoff");
-  float last_value = opt_number_field(L, 1, "last_value", 0);
+static void accumulate_scalar(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+  for (int start = 0; start < sample_count; start += MIX_CHUNK) {
+    int count = sample_count - start < MIX_CHUNK ? sample_count - start : MIX_CHUNK;
+    accumulate_chunk(output, inputs, input_count, initial, start, count);
+  }
+}
+
+static void product_scalar(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+  for (int start = 0; start < sample_count; start += MIX_CHUNK) {
+    int count = sample_count - start < MIX_CHUNK ? sample_count - start : MIX_CHUNK;
+    product_chunk(output, inputs, input_count, initial, start, count);
+  }
+}
 
+static FORCE_INLINE void interleave_loop(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, int sample_count) {
   for (int s = 0; s < sample_count; s++) {
-    float alpha = calculate_filter_coefficient(input_cutoff[s]);
-    last_value += alpha * (input[s] - last_value);
-    last_value = last_value + 1e-20 - 1e-20; // flush denormals
-    output[s] = last_value;
+    output_stereo[s * 2] = input_left[s];
+    output_stereo[s * 2 + 1] = input_right[s];
   }
+}
 
-  set_number_field(L, 1, "last_value", last_value);
-  return 0;
+static void interleave_scalar(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, int sample_count) {
+#define INTERLEAVE_LOOP(n) interleave_loop(output_stereo, input_left, input_right, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, INTERLEAVE_LOOP);
+#undef INTERLEAVE_LOOP
+}
+
+static FORCE_INLINE void amplitude_loop(float *restrict output, const float *restrict input_left, const float *restrict input_right, int sample_count) {
+  for (int s = 0; s < sample_count; s++) {
+    float left = fabsf(input_left[s]);
+    float right = fabsf(input_right[s]);
+    output[s] = left > right ? left : right;
+  }
 }
 
-static int l_highpass(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
-  float *input = check_pointer_field(L, 1, "input");
-  float *input_cutoff = check_pointer_field(L, 1, "input_cutoff");
-  float last_value = opt_number_field(L, 1, "last_value", 0);
+static void amplitude_scalar(float *restrict output, const float *restrict input_left, const float *restrict input_right, int sample_count) {
+#define AMPLITUDE_LOOP(n) amplitude_loop(output, input_left, input_right, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, AMPLITUDE_LOOP);
+#undef AMPLITUDE_LOOP
+}
 
+static FORCE_INLINE void scale_loop(float *restrict output, const float *restrict input, const float *restrict gain, int sample_count) {
   for (int s = 0; s < sample_count; s++) {
-    float alpha = calculate_filter_coefficient(input_cutoff[s]);
-    last_value += alpha * (input[s] - last_value);
-    last_value = last_value + 1e-20 - 1e-20; // flush denormals
-    output[s] = input[s] - last_value;
+    output[s] = input[s] * gain[s];
   }
+}
 
-  set_number_field(L, 1, "last_value", last_value);
-  return 0;
+static void scale_scalar(float *restrict output, const float *restrict input, const float *restrict gain, int sample_count) {
+#define SCALE_LOOP(n) scale_loop(output, input, gain, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, SCALE_LOOP);
+#undef SCALE_LOOP
 }
 
-static int l_triangle(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
-  float *input_frequency = check_pointer_field(L, 1, "input_frequency");
-  float *input_duty = check_pointer_field(L, 1, "input_duty");
-  double phase = opt_number_field(L, 1, "phase", 0);
+static FORCE_INLINE void scale_interleave_loop(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, const float *restrict gain, int sample_count) {
+  for (int s = 0; s < sample_count; s++) {
+    output_stereo[s * 2] = input_left[s] * gain[s];
+    output_stereo[s * 2 + 1] = input_right[s] * gain[s];
+  }
+}
 
-  double inv_sample_rate = 1./SAMPLE_RATE;
+static void scale_interleave_scalar(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, const float *restrict gain, int sample_count) {
+#define SCALE_INTERLEAVE_LOOP(n) scale_interleave_loop(output_stereo, input_left, input_right, gain, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, SCALE_INTERLEAVE_LOOP);
+#undef SCALE_INTERLEAVE_LOOP
+}
 
+static FORCE_INLINE float peak_loop(const float *restrict input_left, const float *restrict input_right, int sample_count) {
+  float peak = 0;
   for (int s = 0; s < sample_count; s++) {
-    phase += input_frequency[s] * inv_sample_rate;
-    phase = fmod(phase, 1);
-    float d = maxf(0, minf(1, input_duty[s]));
-    if (phase < d) {
-      output[s] = phase/d * 2 - 1;
-    } else {
-      output[s] = (1-phase)/(1-d) * 2 - 1;
+    float left = fabsf(input_left[s]);
+    float right = fabsf(input_right[s]);
+    peak = left > peak ? left : peak;
+    peak = right > peak ? right : peak;
+  }
+  return peak;
+}
+
+static float peak_scalar(const float *restrict input_left, const float *restrict input_right, int sample_count) {
+#define PEAK_LOOP(n) return peak_loop(input_left, input_right, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, PEAK_LOOP);
+#undef PEAK_LOOP
+}
+
+static void noise_scalar(float *restrict output, NoiseState *restrict state, int sample_count) {
+  for (int start = 0; start < sample_count; start += NOISE_LANES) {
+    float step[NOISE_LANES];
+    for (int l = 0; l < NOISE_LANES; l++) {
+      uint64_t s0 = state->s0[l];
+      uint64_t s1 = state->s1[l];
+      step[l] = noise_float(s0 + s1);
+      s1 ^= s0;
+      state->s0[l] = rotl64(s0, 24) ^ s1 ^ (s1 << 16);
+      state->s1[l] = rotl64(s1, 37);
     }
+    int count = sample_count - start < NOISE_LANES ? sample_count - start : NOISE_LANES;
+    memcpy(output + start, step, count * sizeof(float));
   }
+}
 
-  set_number_field(L, 1, "phase", phase);
-  return 0;
+#if defined(DSP_X86) && defined(__GNUC__)
+#define DSP_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void fill_avx2(float *restrict output, float value, int sample_count) {
+  __m256 v = _mm256_set1_ps(value);
+  int s = 0;
+  for (; s + 8 <= sample_count; s += 8) {
+    _mm256_storeu_ps(output + s, v);
+  }
+  fill_loop(output + s, value, sample_count - s);
 }
 
-enum {
-  ADSR_ATTACK,
-  ADSR_DECAY,
-  ADSR_SUSTAIN,
-  ADSR_RELEASE,
-};
+AVX2 static FORCE_INLINE void accumulate_avx2_loop(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+  int start = 0;
+  for (; start + MIX_CHUNK <= sample_count; start += MIX_CHUNK) {
+    __m256 a = _mm256_set1_ps(initial);
+    __m256 b = a;
+    __m256 c = a;
+    __m256 d = a;
+    for (int i = 0; i < input_count; i++) {
+      const float *input = inputs[i] + start;
+      a = _mm256_add_ps(a, _mm256_loadu_ps(input));
+      b = _mm256_add_ps(b, _mm256_loadu_ps(input + 8));
+      c = _mm256_add_ps(c, _mm256_loadu_ps(input + 16));
+      d = _mm256_add_ps(d, _mm256_loadu_ps(input + 24));
+    }
+    _mm256_storeu_ps(output + start, a);
+    _mm256_storeu_ps(output + start + 8, b);
+    _mm256_storeu_ps(output + start + 16, c);
+    _mm256_storeu_ps(output + start + 24, d);
+  }
+  if (start < sample_count) {
+    accumulate_chunk(output, inputs, input_count, initial, start, sample_count - start);
+  }
+}
 
-static int l_adsr(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
-  float *input_gate = check_pointer_field(L, 1, "input_gate");
-  double attack = check_number_field(L, 1, "attack");
-  double decay = check_number_field(L, 1, "decay");
-  double sustain = check_number_field(L, 1, "sustain");
-  double release = check_number_field(L, 1, "release");
+AVX2 static void accumulate_avx2(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+#define ACCUMULATE_AVX2_LOOP(n) accumulate_avx2_loop(output, inputs, input_count, initial, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, ACCUMULATE_AVX2_LOOP);
+#undef ACCUMULATE_AVX2_LOOP
+}
 
-  int stage = opt_integer_field(L, 1, "stage", ADSR_RELEASE);
-  double value = opt_number_field(L, 1, "value", 0);
-  double release_delta = opt_number_field(L, 1, "release_delta", 0);
+AVX2 static FORCE_INLINE void product_avx2_loop(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+  int start = 0;
+  for (; start + MIX_CHUNK <= sample_count; start += MIX_CHUNK) {
+    __m256 a = _mm256_set1_ps(initial);
+    __m256 b = a;
+    __m256 c = a;
+    __m256 d = a;
+    for (int i = 0; i < input_count; i++) {
+      const float *input = inputs[i] + start;
+      a = _mm256_mul_ps(a, _mm256_loadu_ps(input));
+      b = _mm256_mul_ps(b, _mm256_loadu_ps(input + 8));
+      c = _mm256_mul_ps(c, _mm256_loadu_ps(input + 16));
+      d = _mm256_mul_ps(d, _mm256_loadu_ps(input + 24));
+    }
+    _mm256_storeu_ps(output + start, a);
+    _mm256_storeu_ps(output + start + 8, b);
+    _mm256_storeu_ps(output + start + 16, c);
+    _mm256_storeu_ps(output + start + 24, d);
+  }
+  if (start < sample_count) {
+    product_chunk(output, inputs, input_count, initial, start, sample_count - start);
+  }
+}
 
-  double attack_delta = 1 / max(1, attack * SAMPLE_RATE);
-  double decay_delta = -(1 - sustain) / max(1, decay * SAMPLE_RATE);
+AVX2 static void product_avx2(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+#define PRODUCT_AVX2_LOOP(n) product_avx2_loop(output, inputs, input_count, initial, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, PRODUCT_AVX2_LOOP);
+#undef PRODUCT_AVX2_LOOP
+}
 
-  for (int s = 0; s < sample_count; s++) {
-    if (input_gate[s] >= 0.5f) {
-      if (stage == ADSR_RELEASE) {
-        stage = ADSR_ATTACK;
-      }
-    } else if (stage != ADSR_RELEASE) {
-      stage = ADSR_RELEASE;
-      release_delta = -value / max(1, release * SAMPLE_RATE);
+AVX2 static void interleave_avx2(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, int sample_count) {
+  int s = 0;
+  for (; s + 8 <= sample_count; s += 8) {
+    __m256 left = _mm256_loadu_ps(input_left + s);
+    __m256 right = _mm256_loadu_ps(input_right + s);
+    // unpack interleaves within 128 bit lanes, permute puts the lanes in order
+    __m256 low = _mm256_unpacklo_ps(left, right);
+    __m256 high = _mm256_unpackhi_ps(left, right);
+    _mm256_storeu_ps(output_stereo + s * 2, _mm256_permute2f128_ps(low, high, 0x20));
+    _mm256_storeu_ps(output_stereo + s * 2 + 8, _mm256_permute2f128_ps(low, high, 0x31));
+  }
+  interleave_loop(output_stereo + s * 2, input_left + s, input_right + s, sample_count - s);
+}
+
+AVX2 static void amplitude_avx2(float *restrict output, const float *restrict input_left, const float *restrict input_right, int sample_count) {
+  __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  int s = 0;
+  for (; s + 8 <= sample_count; s += 8) {
+    __m256 left = _mm256_and_ps(_mm256_loadu_ps(input_left + s), abs_mask);
+    __m256 right = _mm256_and_ps(_mm256_loadu_ps(input_right + s), abs_mask);
+    _mm256_storeu_ps(output + s, _mm256_max_ps(left, right));
+  }
+  amplitude_loop(output + s, input_left + s, input_right + s, sample_count - s);
+}
+
+AVX2 static FORCE_INLINE void scale_avx2_loop(float *restrict output, const float *restrict input, const float *restrict gain, int sample_count) {
+  int s = 0;
+  for (; s + 8 <= sample_count; s += 8) {
+    _mm256_storeu_ps(output + s, _mm256_mul_ps(_mm256_loadu_ps(input + s), _mm256_loadu_ps(gain + s)));
+  }
+  scale_loop(output + s, input + s, gain + s, sample_count - s);
+}
+
+AVX2 static void scale_avx2(float *restrict output, const float *restrict input, const float *restrict gain, int sample_count) {
+#define SCALE_AVX2_LOOP(n) scale_avx2_loop(output, input, gain, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, SCALE_AVX2_LOOP);
+#undef SCALE_AVX2_LOOP
+}
+
+#define ROTL64_AVX2(x, k) _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - (k)))
+
+AVX2 static void scale_interleave_avx2(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, const float *restrict gain, int sample_count) {
+  int s = 0;
+  for (; s + 8 <= sample_count; s += 8) {
+    __m256 g = _mm256_loadu_ps(gain + s);
+    __m256 left = _mm256_mul_ps(_mm256_loadu_ps(input_left + s), g);
+    __m256 right = _mm256_mul_ps(_mm256_loadu_ps(input_right + s), g);
+    __m256 low = _mm256_unpacklo_ps(left, right);
+    __m256 high = _mm256_unpackhi_ps(left, right);
+    _mm256_storeu_ps(output_stereo + s * 2, _mm256_permute2f128_ps(low, high, 0x20));
+    _mm256_storeu_ps(output_stereo + s * 2 + 8, _mm256_permute2f128_ps(low, high, 0x31));
+  }
+  scale_interleave_loop(output_stereo + s * 2, input_left + s, input_right + s, gain + s, sample_count - s);
+}
+
+AVX2 static float peak_avx2(const float *restrict input_left, const float *restrict input_right, int sample_count) {
+  __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 peak = _mm256_setzero_ps();
+  int s = 0;
+  for (; s + 8 <= sample_count; s += 8) {
+    peak = _mm256_max_ps(peak, _mm256_and_ps(_mm256_loadu_ps(input_left + s), abs_mask));
+    peak = _mm256_max_ps(peak, _mm256_and_ps(_mm256_loadu_ps(input_right + s), abs_mask));
+  }
+  __m128 half = _mm_max_ps(_mm256_castps256_ps128(peak), _mm256_extractf128_ps(peak, 1));
+  half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+  half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+  float rest = peak_loop(input_left + s, input_right + s, sample_count - s);
+  float result = _mm_cvtss_f32(half);
+  return rest > result ? rest : result;
+}
+
+AVX2 static void noise_avx2(float *restrict output, NoiseState *restrict state, int sample_count) {
+  __m256i s0[2], s1[2];
+  for (int h = 0; h < 2; h++) {
+    s0[h] = _mm256_loadu_si256((const __m256i *) (state->s0 + h * 4));
+    s1[h] = _mm256_loadu_si256((const __m256i *) (state->s1 + h * 4));
+  }
+  const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  const __m256i exponent = _mm256_set1_epi32(0x40000000);
+  const __m256 three = _mm256_set1_ps(3.0f);
+  for (int start = 0; start < sample_count; start += NOISE_LANES) {
+    __m256i packed[2];
+    for (int h = 0; h < 2; h++) {
+      __m256i result = _mm256_srli_epi64(_mm256_add_epi64(s0[h], s1[h]), 41);
+      packed[h] = _mm256_permutevar8x32_epi32(result, even);
+      __m256i x = _mm256_xor_si256(s1[h], s0[h]);
+      s0[h] = _mm256_xor_si256(_mm256_xor_si256(ROTL64_AVX2(s0[h], 24), x), _mm256_slli_epi64(x, 16));
+      s1[h] = ROTL64_AVX2(x, 37);
     }
-    switch(stage) {
-      case ADSR_ATTACK:
-        value += attack_delta;
-        if (value >= 1) {
-          value = 1;
-          stage = ADSR_DECAY;
-        }
-        break;
-      case ADSR_DECAY:
-        value += decay_delta;
-        if (value <= sustain) {
-          value = sustain;
-          stage = ADSR_SUSTAIN;
-        }
-        break;
-      case ADSR_SUSTAIN:
-        break;
-      case ADSR_RELEASE:
-        if (value > 0) {
-          value += release_delta;
-          if (value < 0) {
-            value = 0;
-          }
-        }
-        break;
+    __m256i mantissa = _mm256_permute2x128_si256(packed[0], packed[1], 0x20);
+    __m256 step = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_or_si256(mantissa, exponent)), three);
+    if (sample_count - start >= NOISE_LANES) {
+      _mm256_storeu_ps(output + start, step);
+    } else {
+      float tail[NOISE_LANES];
+      _mm256_storeu_ps(tail, step);
+      memcpy(output + start, tail, (sample_count - start) * sizeof(float));
     }
-    assert(value >= 0 && value <= 1);
-    output[s] = value;
   }
+  for (int h = 0; h < 2; h++) {
+    _mm256_storeu_si256((__m256i *) (state->s0 + h * 4), s0[h]);
+    _mm256_storeu_si256((__m256i *) (state->s1 + h * 4), s1[h]);
+  }
+}
+#endif
 
-  set_integer_field(L, 1, "stage", stage);
-  set_number_field(L, 1, "value", value);
-  set_number_field(L, 1, "release_delta", release_delta);
-  return 0;
+#ifdef DSP_NEON
+static void fill_neon(float *restrict output, float value, int sample_count) {
+  float32x4_t v = vdupq_n_f32(value);
+  int s = 0;
+  for (; s + 4 <= sample_count; s += 4) {
+    vst1q_f32(output + s, v);
+  }
+  fill_scalar(output + s, value, sample_count - s);
 }
 
-static int l_stereo_limiter(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output_left = check_pointer_field(L, 1, "output_left");
-  float *output_right = check_pointer_field(L, 1, "output_right");
-  float *input_left = check_pointer_field(L, 1, "input_left");
-  float *input_right = check_pointer_field(L, 1, "input_right");
-  double divisor = opt_number_field(L, 1, "divisor", 1);
-  bool hit_limiter = false;
+static FORCE_INLINE void accumulate_neon_loop(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+  int start = 0;
+  for (; start + 16 <= sample_count; start += 16) {
+    float32x4_t a = vdupq_n_f32(initial);
+    float32x4_t b = a;
+    float32x4_t c = a;
+    float32x4_t d = a;
+    for (int i = 0; i < input_count; i++) {
+      const float *input = inputs[i] + start;
+      a = vaddq_f32(a, vld1q_f32(input));
+      b = vaddq_f32(b, vld1q_f32(input + 4));
+      c = vaddq_f32(c, vld1q_f32(input + 8));
+      d = vaddq_f32(d, vld1q_f32(input + 12));
+    }
+    vst1q_f32(output + start, a);
+    vst1q_f32(output + start + 4, b);
+    vst1q_f32(output + start + 8, c);
+    vst1q_f32(output + start + 12, d);
+  }
+  if (start < sample_count) {
+    accumulate_chunk(output, inputs, input_count, initial, start, sample_count - start);
+  }
+}
 
-  for (int s = 0; s < sample_count; s++) {
-    float amplitude = maxf(fabsf(input_left[s]), fabsf(input_right[s]));
-    if (amplitude > 1) {
-      divisor = max(divisor, amplitude);
-      hit_limiter = true;
+static void accumulate_neon(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+#define ACCUMULATE_NEON_LOOP(n) accumulate_neon_loop(output, inputs, input_count, initial, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, ACCUMULATE_NEON_LOOP);
+#undef ACCUMULATE_NEON_LOOP
+}
+
+static FORCE_INLINE void product_neon_loop(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+  int start = 0;
+  for (; start + 16 <= sample_count; start += 16) {
+    float32x4_t a = vdupq_n_f32(initial);
+    float32x4_t b = a;
+    float32x4_t c = a;
+    float32x4_t d = a;
+    for (int i = 0; i < input_count; i++) {
+      const float *input = inputs[i] + start;
+      a = vmulq_f32(a, vld1q_f32(input));
+      b = vmulq_f32(b, vld1q_f32(input + 4));
+      c = vmulq_f32(c, vld1q_f32(input + 8));
+      d = vmulq_f32(d, vld1q_f32(input + 12));
     }
-    assert(divisor >= 1);
-    output_left[s] = input_left[s] / divisor;
-    output_right[s] = input_right[s] / divisor;
-    divisor = max(1, divisor * 0.99);
+    vst1q_f32(output + start, a);
+    vst1q_f32(output + start + 4, b);
+    vst1q_f32(output + start + 8, c);
+    vst1q_f32(output + start + 12, d);
   }
+  if (start < sample_count) {
+    product_chunk(output, inputs, input_count, initial, start, sample_count - start);
+  }
+}
 
-  set_number_field(L, 1, "divisor", divisor);
-  set_bool_field(L, 1, "hit_limiter", hit_limiter);
-  return 0;
+static void product_neon(float *restrict output, float *const *inputs, int input_count, float initial, int sample_count) {
+#define PRODUCT_NEON_LOOP(n) product_neon_loop(output, inputs, input_count, initial, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, PRODUCT_NEON_LOOP);
+#undef PRODUCT_NEON_LOOP
+}
+
+static void interleave_neon(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, int sample_count) {
+  int s = 0;
+  for (; s + 4 <= sample_count; s += 4) {
+    float32x4x2_t stereo = { { vld1q_f32(input_left + s), vld1q_f32(input_right + s) } };
+    vst2q_f32(output_stereo + s * 2, stereo);
+  }
+  interleave_scalar(output_stereo + s * 2, input_left + s, input_right + s, sample_count - s);
 }
 
-static int l_stereo_interleave(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count"); // number of stereo frames to output
-  float *output_stereo = check_pointer_field(L, 1, "output_stereo");
-  float *input_left = check_pointer_field(L, 1, "input_left");
-  float *input_right = check_pointer_field(L, 1, "input_right");
+static void amplitude_neon(float *restrict output, const float *restrict input_left, const float *restrict input_right, int sample_count) {
+  int s = 0;
+  for (; s + 4 <= sample_count; s += 4) {
+    vst1q_f32(output + s, vmaxq_f32(vabsq_f32(vld1q_f32(input_left + s)), vabsq_f32(vld1q_f32(input_right + s))));
+  }
+  amplitude_scalar(output + s, input_left + s, input_right + s, sample_count - s);
+}
 
-  for (int s = 0; s < sample_count; s++) {
-    output_stereo[s * 2] = input_left[s];
-    output_stereo[s * 2 + 1] = input_right[s];
+static FORCE_INLINE void scale_neon_loop(float *restrict output, const float *restrict input, const float *restrict gain, int sample_count) {
+  int s = 0;
+  for (; s + 4 <= sample_count; s += 4) {
+    vst1q_f32(output + s, vmulq_f32(vld1q_f32(input + s), vld1q_f32(gain + s)));
   }
+  scale_scalar(output + s, input + s, gain + s, sample_count - s);
+}
 
-  return 0;
+static void scale_neon(float *restrict output, const float *restrict input, const float *restrict gain, int sample_count) {
+#define SCALE_NEON_LOOP(n) scale_neon_loop(output, input, gain, n)
+  SPECIALIZE_BLOCK_SIZE(sample_count, SCALE_NEON_LOOP);
+#undef SCALE_NEON_LOOP
 }
 
-static int l_delay_writer(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *buffer = check_pointer_field(L, 1, "buffer");
-  int buffer_size = check_integer_field(L, 1, "buffer_size");
-  int write_index = check_integer_field(L, 1, "write_index");
-  float *input = check_pointer_field(L, 1, "input");
+static void scale_interleave_neon(float *restrict output_stereo, const float *restrict input_left, const float *restrict input_right, const float *restrict gain, int sample_count) {
+  int s = 0;
+  for (; s + 4 <= sample_count; s += 4) {
+    float32x4_t g = vld1q_f32(gain + s);
+    float32x4x2_t stereo = { { vmulq_f32(vld1q_f32(input_left + s), g), vmulq_f32(vld1q_f32(input_right + s), g) } };
+    vst2q_f32(output_stereo + s * 2, stereo);
+  }
+  scale_interleave_scalar(output_stereo + s * 2, input_left + s, input_right + s, gain + s, sample_count - s);
+}
 
-  for (int s = 0; s < sample_count; s++) {
-    buffer[write_index] = input[s];
-    write_index = (write_index + 1) % buffer_size;
+static float peak_neon(const float *restrict input_left, const float *restrict input_right, int sample_count) {
+  float32x4_t peak = vdupq_n_f32(0);
+  int s = 0;
+  for (; s + 4 <= sample_count; s += 4) {
+    peak = vmaxq_f32(peak, vabsq_f32(vld1q_f32(input_left + s)));
+    peak = vmaxq_f32(peak, vabsq_f32(vld1q_f32(input_right + s)));
   }
+  float rest = peak_scalar(input_left + s, input_right + s, sample_count - s);
+  float32x2_t half = vpmax_f32(vget_low_f32(peak), vget_high_f32(peak));
+  float result = vget_lane_f32(vpmax_f32(half, half), 0);
+  return rest > result ? rest : result;
+}
 
-  set_number_field(L, 1, "write_index", write_index);
-  return 0;
+#define ROTL64_NEON(x, k) vorrq_u64(vshlq_n_u64(x, k), vshrq_n_u64(x, 64 - (k)))
+
+static void noise_neon(float *restrict output, NoiseState *restrict state, int sample_count) {
+  uint64x2_t s0[4], s1[4];
+  for (int q = 0; q < 4; q++) {
+    s0[q] = vld1q_u64(state->s0 + q * 2);
+    s1[q] = vld1q_u64(state->s1 + q * 2);
+  }
+  const uint32x4_t exponent = vdupq_n_u32(0x40000000);
+  const float32x4_t three = vdupq_n_f32(3.0f);
+  for (int start = 0; start < sample_count; start += NOISE_LANES) {
+    uint32x2_t mantissa[4];
+    for (int q = 0; q < 4; q++) {
+      mantissa[q] = vmovn_u64(vshrq_n_u64(vaddq_u64(s0[q], s1[q]), 41));
+      uint64x2_t x = veorq_u64(s1[q], s0[q]);
+      s0[q] = veorq_u64(veorq_u64(ROTL64_NEON(s0[q], 24), x), vshlq_n_u64(x, 16));
+      s1[q] = ROTL64_NEON(x, 37);
+    }
+    float step[NOISE_LANES];
+    for (int h = 0; h < 2; h++) {
+      uint32x4_t bits = vorrq_u32(vcombine_u32(mantissa[h * 2], mantissa[h * 2 + 1]), exponent);
+      vst1q_f32(step + h * 4, vsubq_f32(vreinterpretq_f32_u32(bits), three));
+    }
+    int count = sample_count - start < NOISE_LANES ? sample_count - start : NOISE_LANES;
+    memcpy(output + start, step, count * sizeof(float));
+  }
+  for (int q = 0; q < 4; q++) {
+    vst1q_u64(state->s0 + q * 2, s0[q]);
+    vst1q_u64(state->s1 + q * 2, s1[q]);
+  }
 }
+#endif
 
-static int l_delay_reader(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *buffer = check_pointer_field(L, 1, "buffer");
-  int buffer_size = check_integer_field(L, 1, "buffer_size");
-  int read_index = check_integer_field(L, 1, "read_index");
-  int min_delay_samples = check_integer_field(L, 1, "min_delay_samples");
-  int max_delay_samples = check_integer_field(L, 1, "max_delay_samples");
-  float *output = check_pointer_field(L, 1, "output");
-  float *input_delay_time = check_pointer_field(L, 1, "input_delay_time");
+static Kernels kernels = {
+  fill_scalar,
+  accumulate_scalar,
+  product_scalar,
+  interleave_scalar,
+  amplitude_scalar,
+  scale_scalar,
+  scale_interleave_scalar,
+  peak_scalar,
+  noise_scalar,
+};
 
-  for (int s = 0; s < sample_count; s++) {
-    float delay_time = input_delay_time[s];
-    int delay_samples = maxi(min_delay_samples, mini(max_delay_samples, (int)floor(delay_time * SAMPLE_RATE + 0.5)));
-    int index = (read_index - delay_samples + buffer_size) % buffer_size;
-    output[s] = buffer[index];
-    read_index++;
+static const char *kernel_set = "scalar";
+
+// DSP_KERNELS=scalar in the environment keeps the scalar kernels, to compare
+// them against the simd ones
+static void select_kernels(void) {
+  const char *forced = getenv("DSP_KERNELS");
+  if (forced && strcmp(forced, "scalar") == 0) {
+    return;
+  }
+#ifdef DSP_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    kernels = (Kernels) {
+      fill_avx2,
+      accumulate_avx2,
+      product_avx2,
+      interleave_avx2,
+      amplitude_avx2,
+      scale_avx2,
+      scale_interleave_avx2,
+      peak_avx2,
+      noise_avx2,
+    };
+    kernel_set = "avx2";
   }
+#endif
+#ifdef DSP_NEON
+  kernels = (Kernels) {
+    fill_neon,
+    accumulate_neon,
+    product_neon,
+    interleave_neon,
+    amplitude_neon,
+    scale_neon,
+    scale_interleave_neon,
+    peak_neon,
+    noise_neon,
+  };
+  kernel_set = "neon";
+#endif
+}
 
-  // note: do not write back read_index
+static int l_get_kernel_set(lua_State *L) {
+  lua_pushstring(L, kernel_set);
+  return 1;
+}
+
+// denormals
+//
+// feedback loops like filters and release tails decay into subnormal floats,
+// which are many times slower on most cpus. instead of nudging values in
+// every loop, the threads that run nodes flush them to zero in hardware:
+// FTZ and DAZ in MXCSR on x86, FZ in FPCR or FPSCR on arm. the mode is per
+// thread, so dsp_c.flush_denormals sets it on the calling thread and worker
+// threads pick it up before their next level
+
+static shared_int denormals_flushed = 0;
+
+static void flush_denormals_on_this_thread(void) {
+#if defined(DSP_X86)
+  _mm_setcsr(_mm_getcsr() | 0x8040);
+#elif defined(__aarch64__)
+  uint64_t fpcr;
+  __asm__ volatile("mrs %0, fpcr" : "=r"(fpcr));
+  __asm__ volatile("msr fpcr, %0" : : "r"(fpcr | (1 << 24)));
+#elif defined(__arm__) && defined(__ARM_FP)
+  uint32_t fpscr;
+  __asm__ volatile("vmrs %0, fpscr" : "=r"(fpscr));
+  __asm__ volatile("vmsr fpscr, %0" : : "r"(fpscr | (1 << 24)));
+#endif
+}
 
+static int l_flush_denormals(lua_State *L) {
+  flush_denormals_on_this_thread();
+  SHARED_STORE(denormals_flushed, 1);
   return 0;
 }
 
-static double random_double() {
-  return (next() >> 11) * 0x1.0p-53;
+// streams
+
+static void *aligned_malloc(size_t size) {
+#ifdef _WIN32
+  return _aligned_malloc(size, STREAM_ALIGNMENT);
+#else
+  void *ptr;
+  return posix_memalign(&ptr, STREAM_ALIGNMENT, size) == 0 ? ptr : NULL;
+#endif
 }
 
-static int l_white_noise(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
+static void aligned_free(void *ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
 
-  for (int s = 0; s < sample_count; s++) {
-    output[s] = random_double() * 2 - 1;
-  }
+// the max block size is an engine setting up to MAX_BLOCK_SIZE, which every
+// scratch buffer on the stack is sized for. stream buffers hold
+// engine_block_size samples per channel, so it can only change before the
+// first stream is made
+#define MAX_BLOCK_SIZE 2048
+
+static int engine_block_size = 512;
+static shared_int streams_made = 0;
+
+static int l_get_max_block_size(lua_State *L) {
+  lua_pushinteger(L, engine_block_size);
+  return 1;
+}
 
+static int l_set_max_block_size(lua_State *L) {
+  int block_size = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, block_size >= 1 && block_size <= MAX_BLOCK_SIZE, 1, "max block size must be between 1 and 2048");
+  if (block_size != engine_block_size && SHARED_LOAD(streams_made)) {
+    return luaL_error(L, "the max block size can't change after streams are made");
+  }
+  engine_block_size = block_size;
   return 0;
 }
 
-static int l_pink_noise(lua_State *L) {
-  int sample_count = check_integer_field(L, 1, "sample_count");
-  float *output = check_pointer_field(L, 1, "output");
-  double b0 = opt_number_field(L, 1, "b0", 0);
-  double b1 = opt_number_field(L, 1, "b1", 0);
-  double b2 = opt_number_field(L, 1, "b2", 0);
-  double b3 = opt_number_field(L, 1, "b3", 0);
-  double b4 = opt_number_field(L, 1, "b4", 0);
-  double b5 = opt_number_field(L, 1, "b5", 0);
-  double b6 = opt_number_field(L, 1, "b6", 0);
+static int check_sample_count(lua_State *L, int n) {
+  int sample_count = luaL_checkinteger(L, n);
+  luaL_argcheck(L, sample_count >= 0 && sample_count <= engine_block_size, n, "sample_count must be between 0 and the max block size");
+  return sample_count;
+}
 
-  for (int s = 0; s < sample_count; s++) {
-    float white = random_double() * 2 - 1;
-    b0 = 0.99886f * b0 + white * 0.0555179f;
-    b1 = 0.99332f * b1 + white * 0.0750759f;
-    b2 = 0.96900f * b2 + white * 0.1538520f;
-    b3 = 0.86650f * b3 + white * 0.3104856f;
-    b4 = 0.55000f * b4 + white * 0.5329522f;
-    b5 = -0.7616f * b5 - white * 0.0168980f;
-    output[s] = b0 + b1 + b2 + b3 + b4 + b5 + b6 + white * 0.5362f;
-    b6 = white * 0.115926f;
+static Stream *push_stream(lua_State *L, float *samples, int channel_count) {
+  Stream *stream = lua_newuserdata(L, sizeof(Stream));
+  memset(stream, 0, sizeof(Stream));
+  stream->samples = samples;
+  stream->buffer = samples;
+  stream->channel_count = channel_count;
+  stream->schedule_index = -1;
+  luaL_getmetatable(L, STREAM_TYPE);
+  lua_setmetatable(L, -2);
+  return stream;
+}
+
+// dsp_c.new_stream(channel_count?) makes a stream with a buffer for nodes to
+// write
+static int l_new_stream(lua_State *L) {
+  int channel_count = luaL_optinteger(L, 1, 1);
+  luaL_argcheck(L, channel_count >= 1, 1, "channel_count must be at least 1");
+  float *samples = aligned_malloc(channel_count * engine_block_size * sizeof(float));
+  if (!samples) {
+    return luaL_error(L, "out of memory");
   }
+  SHARED_STORE(streams_made, 1);
+  kernels.fill(samples, 0, channel_count * engine_block_size);
+  push_stream(L, samples, channel_count);
+  return 1;
+}
 
-  set_number_field(L, 1, "b0", b0);
-  set_number_field(L, 1, "b1", b1);
-  set_number_field(L, 1, "b2", b2);
-  set_number_field(L, 1, "b3", b3);
-  set_number_field(L, 1, "b4", b4);
-  set_number_field(L, 1, "b5", b5);
-  set_number_field(L, 1, "b6", b6);
+// dsp_c.new_constant(value) makes a stream without a buffer
+static int l_new_constant(lua_State *L) {
+  Stream *stream = push_stream(L, NULL, 1);
+  stream->constant = true;
+  stream->value = luaL_optnumber(L, 1, 0);
+  return 1;
+}
 
+// dsp_c.set_constant(stream, value) makes the stream constant until a node
+// writes to it again
+static int l_set_constant(lua_State *L) {
+  Stream *stream = luaL_checkudata(L, 1, STREAM_TYPE);
+  stream->constant = true;
+  stream->value = luaL_checknumber(L, 2);
   return 0;
 }
 
-static const luaL_Reg dsp_c_module[] = {
-  { "get_sample_rate", l_get_sample_rate },
-  { "set", l_set },
-  { "add", l_add },
-  { "multiply", l_multiply },
-  { "lowpass", l_lowpass },
-  { "highpass", l_highpass },
-  { "triangle", l_triangle },
-  { "adsr", l_adsr },
-  { "stereo_limiter", l_stereo_limiter },
-  { "stereo_interleave", l_stereo_interleave },
-  { "delay_writer", l_delay_writer },
-  { "delay_reader", l_delay_reader },
-  { "white_noise", l_white_noise },
-  { "pink_noise", l_pink_noise },
-  { NULL, NULL }
-};
+static int l_get_channel_count(lua_State *L) {
+  Stream *stream = luaL_checkudata(L, 1, STREAM_TYPE);
+  lua_pushinteger(L, stream->channel_count);
+  return 1;
+}
+
+static int l_stream_gc(lua_State *L) {
+  Stream *stream = luaL_checkudata(L, 1, STREAM_TYPE);
+  aligned_free(stream->buffer);
+  stream->buffer = NULL;
+  stream->samples = NULL;
+  return 0;
+}
+
+// the stream field helpers record the access on the node being created
+
+static Stream *check_stream_field(lua_State *L, int n, const char *name, Node *node) {
+  Stream *stream = check_udata_field(L, n, name, STREAM_TYPE);
+  node_stream_access(L, node, stream, false);
+  return stream;
+}
+
+static Stream *check_stream_index(lua_State *L, int n, int index, Node *node) {
+  lua_rawgeti(L, n, index);
+  Stream *stream = luaL_checkudata(L, -1, STREAM_TYPE);
+  lua_pop(L, 1);
+  node_stream_access(L, node, stream, false);
+  return stream;
+}
+
+// outputs need a buffer to write into
+static Stream *check_output_field(lua_State *L, int n, const char *name, Node *node) {
+  Stream *stream = check_udata_field(L, n, name, STREAM_TYPE);
+  if (!stream->samples) {
+    luaL_error(L, "%s can't be a constant stream", name);
+  }
+  node_stream_access(L, node, stream, true);
+  return stream;
+}
+
+// returns the samples of a stream for reading, a constant stream's value is
+// written to scratch, which must hold sample_count samples
+static const float *read_stream(const Stream *stream, float *scratch, int sample_count) {
+  if (stream->constant) {
+    kernels.fill(scratch, stream->value, sample_count);
+    return scratch;
+  }
+  return stream->samples;
+}
+
+// the samples of channel c, a mono stream has the same samples on every
+// channel
+static float *channel_samples(const Stream *stream, int c) {
+  return stream->channel_count > 1 ? stream->samples + c * engine_block_size : stream->samples;
+}
+
+// read_stream for channel c
+static const float *read_channel(const Stream *stream, int c, float *scratch, int sample_count) {
+  if (stream->constant) {
+    kernels.fill(scratch, stream->value, sample_count);
+    return scratch;
+  }
+  return channel_samples(stream, c);
+}
+
+// write_stream for channel c
+static float *write_channel(Stream *stream, int c) {
+  stream->constant = false;
+  return channel_samples(stream, c);
+}
+
+// inputs of multichannel nodes need one channel or as many as the output
+static void check_channel_count(lua_State *L, const Stream *stream, int channel_count, const char *name) {
+  if (stream->channel_count != 1 && stream->channel_count != channel_count) {
+    luaL_error(L, "%s needs 1 or %d channels", name, channel_count);
+  }
+}
+
+// returns the samples of a stream for writing
+static float *write_stream(Stream *stream) {
+  stream->constant = false;
+  return stream->samples;
+}
+
+// marks a stream as holding value for this block instead of writing samples
+static void write_constant(Stream *stream, float value) {
+  stream->constant = true;
+  stream->value = value;
+}
+
+// silence is a constant 0, so idle nodes write it without touching their
+// buffers and the nodes reading it can skip their work too
+static bool is_silent(const Stream *stream) {
+  return stream->constant && stream->value == 0;
+}
+
+// dsp
+
+// the rate of the output, set to the device's before building anything.
+// nodes use the rate of the block they run in
+static double engine_sample_rate = 44100;
+
+static int l_get_sample_rate(lua_State *L) {
+  lua_pushnumber(L, engine_sample_rate);
+  return 1;
+}
+
+static int l_set_sample_rate(lua_State *L) {
+  double sample_rate = luaL_checknumber(L, 1);
+  luaL_argcheck(L, sample_rate > 0, 1, "sample_rate must be positive");
+  engine_sample_rate = sample_rate;
+  return 0;
+}
+
+// the output is constant unless dsp_c.set_value queued a change within the
+// block, then it steps to the new value on that sample
+typedef struct {
+  Node node;
+  Stream *output;
+  float value;
+  EventQueue events;
+} SetNode;
+
+static void set_process(Node *node, Block *block) {
+  SetNode *set = (SetNode *) node;
+  EventQueue *events = &set->events;
+  int sample_count = block->sample_count;
+  if (!has_events(events, sample_count)) {
+    write_constant(set->output, set->value);
+    return;
+  }
+  float *output = write_stream(set->output);
+  int e = 0;
+  for (int s = 0; s < sample_count;) {
+    for (; e < events->count && events->events[e].offset <= s; e++) {
+      set->value = events->events[e].value;
+    }
+    int end = event_run_end(events, e, sample_count);
+    kernels.fill(output + s, set->value, end - s);
+    s = end;
+  }
+  finish_events(events, e, sample_count);
+}
+
+static Node *set_create(lua_State *L, int n) {
+  SetNode *set = new_node(L, sizeof(SetNode), set_process);
+  set->output = check_output_field(L, n, "output", &set->node);
+  set->value = check_number_field(L, n, "value");
+  return &set->node;
+}
+
+static SetNode *check_set(lua_State *L, int n) {
+  Node *node = check_node(L, n);
+  if (node->process != set_process) {
+    luaL_error(L, "expected a set node");
+  }
+  return (SetNode *) node;
+}
+
+// dsp_c.set_value(node, value, offset?)
+static int l_set_value(lua_State *L) {
+  SetNode *set = check_set(L, 1);
+  float value = luaL_checknumber(L, 2);
+  push_event(L, &set->events, 3)->value = value;
+  return 0;
+}
+
+// add and multiply store their inputs after the node, followed by room for
+// the sample pointers of the inputs that aren't constant. every channel of the
+// output is mixed in the same call, the constants are only combined once
+//
+// when a mono mix is the only reader of another mix's output, the graph fuses
+// them: the producer is no longer run on its own, and the consumer evaluates
+// it in chunks small enough to stay in cache instead of going through the
+// producer's stream
+typedef struct MixNode {
+  Node node;
+  Stream *output;
+  bool product;
+  // set when the mix is evaluated by the mix reading its output
+  bool fused;
+  int input_count;
+  // how many inputs are fused mixes, with those mixes in producers
+  int producer_count;
+  struct MixNode **producers;
+  // the inputs that aren't constant this block
+  int varying_count;
+  Stream **varying;
+  float **samples;
+  Stream *inputs[];
+} MixNode;
+
+#define FUSE_CHUNK 64
+
+// whether a fused mix is silent this block, a sum when every input is and a
+// product when any input is
+static bool mix_silent(const MixNode *mix) {
+  for (int i = 0; i < mix->input_count; i++) {
+    bool silent = mix->producers[i] ? mix_silent(mix->producers[i]) : is_silent(mix->inputs[i]);
+    if (silent == mix->product) {
+      return silent;
+    }
+  }
+  return !mix->product;
+}
+
+// whether the mix has to be evaluated per sample this block
+static bool mix_varies(const MixNode *mix) {
+  if (mix_silent(mix)) {
+    return false;
+  }
+  for (int i = 0; i < mix->input_count; i++) {
+    if (mix->producers[i] ? mix_varies(mix->producers[i]) : !mix->inputs[i]->constant) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// writes count samples starting at offset of a fused mix to output
+static void mix_evaluate(const MixNode *mix, float *output, int offset, int count) {
+  if (mix->product && mix_silent(mix)) {
+    for (int s = 0; s < count; s++) {
+      output[s] = 0;
+    }
+    return;
+  }
+  float constant = mix->product ? 1 : 0;
+  for (int i = 0; i < mix->input_count; i++) {
+    if (!mix->producers[i] && mix->inputs[i]->constant) {
+      constant = mix->product ? constant * mix->inputs[i]->value : constant + mix->inputs[i]->value;
+    }
+  }
+  for (int s = 0; s < count; s++) {
+    output[s] = constant;
+  }
+
+  float scratch[FUSE_CHUNK];
+  for (int i = 0; i < mix->input_count; i++) {
+    const float *input;
+    if (mix->producers[i]) {
+      mix_evaluate(mix->producers[i], scratch, offset, count);
+      input = scratch;
+    } else if (!mix->inputs[i]->constant) {
+      input = mix->inputs[i]->samples + offset;
+    } else {
+      continue;
+    }
+    if (mix->product) {
+      for (int s = 0; s < count; s++) {
+        output[s] *= input[s];
+      }
+    } else {
+      for (int s = 0; s < count; s++) {
+        output[s] += input[s];
+      }
+    }
+  }
+}
+
+static void mix_fused_process(MixNode *mix, Block *block) {
+  if (mix_silent(mix)) {
+    write_constant(mix->output, 0);
+    return;
+  }
+  if (!mix_varies(mix)) {
+    float value;
+    mix_evaluate(mix, &value, 0, 1);
+    write_constant(mix->output, value);
+    return;
+  }
+  float *output = write_stream(mix->output);
+  for (int offset = 0; offset < block->sample_count; offset += FUSE_CHUNK) {
+    int count = block->sample_count - offset;
+    mix_evaluate(mix, output + offset, offset, count < FUSE_CHUNK ? count : FUSE_CHUNK);
+  }
+}
+
+// points samples at channel c of every varying input
+static float **mix_channel(MixNode *mix, int c) {
+  for (int i = 0; i < mix->varying_count; i++) {
+    mix->samples[i] = channel_samples(mix->varying[i], c);
+  }
+  return mix->samples;
+}
+
+static void add_process(Node *node, Block *block) {
+  MixNode *mix = (MixNode *) node;
+  if (mix->producer_count > 0) {
+    mix_fused_process(mix, block);
+    return;
+  }
+  // constant inputs are summed once instead of for every sample, so silent
+  // ones cost nothing
+  float sum = 0;
+  int count = 0;
+  for (int i = 0; i < mix->input_count; i++) {
+    Stream *input = mix->inputs[i];
+    if (input->constant) {
+      sum += input->value;
+    } else {
+      mix->varying[count++] = input;
+    }
+  }
+  mix->varying_count = count;
+  if (count == 0) {
+    write_constant(mix->output, sum);
+    return;
+  }
+  write_stream(mix->output);
+  for (int c = 0; c < mix->output->channel_count; c++) {
+    kernels.accumulate(channel_samples(mix->output, c), mix_channel(mix, c), count, sum, block->sample_count);
+  }
+}
+
+static void multiply_process(Node *node, Block *block) {
+  MixNode *mix = (MixNode *) node;
+  if (mix->producer_count > 0) {
+    mix_fused_process(mix, block);
+    return;
+  }
+  // one silent input silences the product without reading the others
+  for (int i = 0; i < mix->input_count; i++) {
+    if (is_silent(mix->inputs[i])) {
+      write_constant(mix->output, 0);
+      return;
+    }
+  }
+  float product = 1;
+  int count = 0;
+  for (int i = 0; i < mix->input_count; i++) {
+    Stream *input = mix->inputs[i];
+    if (input->constant) {
+      product *= input->value;
+    } else {
+      mix->varying[count++] = input;
+    }
+  }
+  mix->varying_count = count;
+  if (count == 0) {
+    write_constant(mix->output, product);
+    return;
+  }
+  write_stream(mix->output);
+  for (int c = 0; c < mix->output->channel_count; c++) {
+    kernels.product(channel_samples(mix->output, c), mix_channel(mix, c), count, product, block->sample_count);
+  }
+}
+
+static MixNode *mix_create(lua_State *L, int n, NodeProcess process) {
+  lua_getfield(L, n, "inputs");
+  int len = lua_objlen(L, -1);
+  lua_pop(L, 1);
+  MixNode *mix = new_node(L, sizeof(MixNode) + len * (2 * sizeof(Stream *) + sizeof(float *) + sizeof(MixNode *)), process);
+  mix->output = check_output_field(L, n, "output", &mix->node);
+  mix->product = process == multiply_process;
+  mix->input_count = len;
+  mix->varying = mix->inputs + len;
+  mix->samples = (float **) (mix->varying + len);
+  mix->producers = (MixNode **) (mix->samples + len);
+  lua_getfield(L, n, "inputs");
+  for (int i = 1; i <= len; i++) {
+    mix->inputs[i - 1] = check_stream_index(L, lua_gettop(L), i, &mix->node);
+    check_channel_count(L, mix->inputs[i - 1], mix->output->channel_count, "inputs");
+  }
+  lua_pop(L, 1);
+  return mix;
+}
+
+static Node *add_create(lua_State *L, int n) {
+  return &mix_create(L, n, add_process)->node;
+}
+
+static Node *multiply_create(lua_State *L, int n) {
+  return &mix_create(L, n, multiply_process)->node;
+}
+
+static double min(double a, double b) {
+  return a < b ? a : b;
+}
+
+static double max(double a, double b) {
+  return a > b ? a : b;
+}
+
+static float minf(float a, float b) {
+  return a < b ? a : b;
+}
+
+static float maxf(float a, float b) {
+  return a > b ? a : b;
+}
+
+static int mini(int a, int b) {
+  return a < b ? a : b;
+}
+
+static int maxi(int a, int b) {
+  return a > b ? a : b;
+}
+
+#define PI 3.14159265358979323846
+
+static float calculate_filter_coefficient(float cutoff_frequency, double sample_rate) {
+  float wc = 2 * PI * maxf(0, minf(0.5, cutoff_frequency / sample_rate));
+  float y = 1 - cosf(wc);
+  return -y + sqrtf(y * (y + 2));
+}
+
+// the coefficient curve sampled over normalized frequencies 0 to 0.5, with one
+// extra entry so interpolation never reads past the end
+#define FILTER_TABLE_SIZE 1024
+
+static float filter_table[FILTER_TABLE_SIZE + 2];
+
+static void init_filter_table(void) {
+  for (int i = 0; i <= FILTER_TABLE_SIZE + 1; i++) {
+    float wc = 2 * PI * minf(0.5, 0.5 * i / FILTER_TABLE_SIZE);
+    float y = 1 - cosf(wc);
+    filter_table[i] = -y + sqrtf(y * (y + 2));
+  }
+}
+
+static float approximate_filter_coefficient(float cutoff_frequency, double sample_rate) {
+  float x = maxf(0, minf(0.5, cutoff_frequency / sample_rate)) * (2 * FILTER_TABLE_SIZE);
+  int i = (int) x;
+  float t = x - i;
+  return filter_table[i] + t * (filter_table[i + 1] - filter_table[i]);
+}
+
+// lowpass and highpass share their state
+//
+// by default the coefficient is calculated for every sample. with control_rate
+// it is only calculated every control_rate samples and interpolated in
+// between, and with approximate it comes from filter_table instead of cosf and
+// sqrtf. a constant cutoff is only calculated once per block. the cutoff is
+// mono, multichannel filters calculate the coefficients once for all channels
+typedef struct {
+  Node node;
+  Stream *output;
+  Stream *input;
+  Stream *input_cutoff;
+  int control_rate;
+  bool approximate;
+  // the coefficient at the end of the last block, negative before the first
+  float alpha;
+  // per channel of the output
+  float last_values[];
+} FilterNode;
+
+static float filter_coefficient(const FilterNode *filter, float cutoff_frequency, double sample_rate) {
+  if (filter->approximate) {
+    return approximate_filter_coefficient(cutoff_frequency, sample_rate);
+  } else {
+    return calculate_filter_coefficient(cutoff_frequency, sample_rate);
+  }
+}
+
+// fills alpha with the coefficient for each sample of the block
+static void filter_coefficients(FilterNode *filter, float *alpha, int sample_count, double sample_rate) {
+  const float *input_cutoff = filter->input_cutoff->samples;
+  int control_rate = filter->control_rate;
+
+  if (control_rate <= 1) {
+    for (int s = 0; s < sample_count; s++) {
+      alpha[s] = filter_coefficient(filter, input_cutoff[s], sample_rate);
+    }
+    filter->alpha = alpha[sample_count - 1];
+    return;
+  }
+
+  float current = filter->alpha;
+  if (current < 0) {
+    current = filter_coefficient(filter, input_cutoff[0], sample_rate);
+  }
+  for (int segment = 0; segment < sample_count; segment += control_rate) {
+    int count = mini(control_rate, sample_count - segment);
+    float target = filter_coefficient(filter, input_cutoff[segment + count - 1], sample_rate);
+    float delta = (target - current) / count;
+    for (int s = 0; s < count; s++) {
+      alpha[segment + s] = current + delta * (s + 1);
+    }
+    current = target;
+  }
+  filter->alpha = current;
+}
+
+// a filter with a constant input is settled once every channel is within
+// FILTER_SETTLED of it. from then on the lowpass outputs the input and the
+// highpass outputs silence as constants, until the input changes
+#define FILTER_SETTLED 1e-6f
+
+static bool filter_settled(FilterNode *filter) {
+  if (!filter->input->constant) {
+    return false;
+  }
+  float value = filter->input->value;
+  for (int c = 0; c < filter->output->channel_count; c++) {
+    if (!(fabsf(filter->last_values[c] - value) < FILTER_SETTLED)) {
+      return false;
+    }
+  }
+  for (int c = 0; c < filter->output->channel_count; c++) {
+    filter->last_values[c] = value;
+  }
+  // a varying cutoff starts interpolating from where it is when the input
+  // changes again
+  filter->alpha = -1;
+  return true;
+}
+
+// highpass is a compile time constant so each caller gets its own loops
+static inline void filter_process(FilterNode *filter, Block *block, const bool highpass) {
+  int sample_count = block->sample_count;
+  float input_scratch[MAX_BLOCK_SIZE];
+  if (filter_settled(filter)) {
+    write_constant(filter->output, highpass ? 0 : filter->input->value);
+    return;
+  }
+  write_stream(filter->output);
+
+  if (sample_count == 0) {
+    return;
+  }
+
+  if (filter->input_cutoff->constant) {
+    float alpha = filter_coefficient(filter, filter->input_cutoff->value, block->sample_rate);
+    filter->alpha = alpha;
+    for (int c = 0; c < filter->output->channel_count; c++) {
+      const float *input = filter->input->constant ? read_stream(filter->input, input_scratch, sample_count) : channel_samples(filter->input, c);
+      float *output = channel_samples(filter->output, c);
+      float last_value = filter->last_values[c];
+      for (int s = 0; s < sample_count; s++) {
+        last_value += alpha * (input[s] - last_value);
+        output[s] = highpass ? input[s] - last_value : last_value;
+      }
+      filter->last_values[c] = last_value;
+    }
+  } else {
+    float alpha[MAX_BLOCK_SIZE];
+    filter_coefficients(filter, alpha, sample_count, block->sample_rate);
+    for (int c = 0; c < filter->output->channel_count; c++) {
+      const float *input = filter->input->constant ? read_stream(filter->input, input_scratch, sample_count) : channel_samples(filter->input, c);
+      float *output = channel_samples(filter->output, c);
+      float last_value = filter->last_values[c];
+      for (int s = 0; s < sample_count; s++) {
+        last_value += alpha[s] * (input[s] - last_value);
+        output[s] = highpass ? input[s] - last_value : last_value;
+      }
+      filter->last_values[c] = last_value;
+    }
+  }
+}
+
+static void lowpass_process(Node *node, Block *block) {
+  filter_process((FilterNode *) node, block, false);
+}
+
+static void highpass_process(Node *node, Block *block) {
+  filter_process((FilterNode *) node, block, true);
+}
+
+static FilterNode *filter_create(lua_State *L, int n, NodeProcess process) {
+  lua_getfield(L, n, "output");
+  Stream *output = luaL_checkudata(L, -1, STREAM_TYPE);
+  int channel_count = output->channel_count;
+  lua_pop(L, 1);
+  FilterNode *filter = new_node(L, sizeof(FilterNode) + channel_count * sizeof(float), process);
+  filter->output = check_output_field(L, n, "output", &filter->node);
+  filter->input = check_stream_field(L, n, "input", &filter->node);
+  filter->input_cutoff = check_stream_field(L, n, "input_cutoff", &filter->node);
+  check_channel_count(L, filter->input, channel_count, "input");
+  check_channel_count(L, filter->input_cutoff, 1, "input_cutoff");
+  float last_value = opt_number_field(L, n, "last_value", 0);
+  for (int c = 0; c < channel_count; c++) {
+    filter->last_values[c] = last_value;
+  }
+  filter->control_rate = opt_integer_field(L, n, "control_rate", 1);
+  filter->approximate = opt_bool_field(L, n, "approximate", false);
+  filter->alpha = -1;
+  luaL_argcheck(L, filter->control_rate >= 1, n, "control_rate must be at least 1");
+  return filter;
+}
+
+static Node *lowpass_create(lua_State *L, int n) {
+  return &filter_create(L, n, lowpass_process)->node;
+}
+
+static Node *highpass_create(lua_State *L, int n) {
+  return &filter_create(L, n, highpass_process)->node;
+}
+
+// oscillators
+//
+// phases are 32 bit fixed point fractions of a cycle, so they wrap around for
+// free instead of needing fmod. each block first accumulates the phases, then
+// evaluates the shape without branches
+
+enum {
+  SHAPE_TRIANGLE,
+  SHAPE_SAW,
+  SHAPE_SQUARE,
+  SHAPE_SINE,
+};
+
+static const char *const shape_names[] = { "triangle", "saw", "square", "sine", NULL };
+
+#define PHASE_SCALE 4294967296.0 // 2^32
+
+static uint32_t phase_increment(float frequency, double sample_rate) {
+  // through int64 so negative frequencies wrap backwards
+  return (uint32_t) (int64_t) (frequency * (PHASE_SCALE / sample_rate));
+}
+
+// phase[s] is the phase after sample s
+static void accumulate_phase(uint32_t *restrict phase, uint32_t *state, const Stream *frequency, int sample_count, double sample_rate) {
+  uint32_t current = *state;
+  if (frequency->constant) {
+    uint32_t increment = phase_increment(frequency->value, sample_rate);
+    for (int s = 0; s < sample_count; s++) {
+      phase[s] = current + increment * (uint32_t) (s + 1);
+    }
+  } else {
+    uint32_t increment[MAX_BLOCK_SIZE];
+    for (int s = 0; s < sample_count; s++) {
+      increment[s] = phase_increment(frequency->samples[s], sample_rate);
+    }
+    for (int s = 0; s < sample_count; s++) {
+      current += increment[s];
+      phase[s] = current;
+    }
+  }
+  if (sample_count > 0) {
+    *state = phase[sample_count - 1];
+  }
+}
+
+// the rising and falling slopes of a triangle with duty d, kept finite so
+// the min below never sees inf * 0
+static void triangle_slopes(float duty, float *rise, float *fall) {
+  float d = maxf(1e-6f, minf(1 - 1e-6f, duty));
+  *rise = 2 / d;
+  *fall = 2 / (1 - d);
+}
+
+// sin(pi * v) for v in [-0.5, 0.5]
+static inline float sin_pi_half(float v) {
+  float v2 = v * v;
+  float p = 0.0821458866f; // pi^9 / 9!
+  p = p * v2 - 0.599264530f; // pi^7 / 7!
+  p = p * v2 + 2.55016404f; // pi^5 / 5!
+  p = p * v2 - 5.16771278f; // pi^3 / 3!
+  p = p * v2 + 3.14159265f;
+  return p * v;
+}
+
+// writes the shape for the given phases, duty is only read by shapes that
+// use it and may be constant
+static void render_shape(int shape, float *restrict output, const uint32_t *restrict phase, const Stream *duty, int sample_count) {
+  const float scale = 0x1p-32f;
+  switch (shape) {
+    case SHAPE_TRIANGLE:
+      if (!duty || duty->constant) {
+        float rise, fall;
+        triangle_slopes(duty ? duty->value : 0.5f, &rise, &fall);
+        for (int s = 0; s < sample_count; s++) {
+          float x = phase[s] * scale;
+          output[s] = minf(x * rise, (1 - x) * fall) - 1;
+        }
+      } else {
+        for (int s = 0; s < sample_count; s++) {
+          float rise, fall;
+          triangle_slopes(duty->samples[s], &rise, &fall);
+          float x = phase[s] * scale;
+          output[s] = minf(x * rise, (1 - x) * fall) - 1;
+        }
+      }
+      break;
+    case SHAPE_SAW:
+      for (int s = 0; s < sample_count; s++) {
+        output[s] = phase[s] * (2 * scale) - 1;
+      }
+      break;
+    case SHAPE_SQUARE:
+      if (!duty || duty->constant) {
+        float d = duty ? duty->value : 0.5f;
+        for (int s = 0; s < sample_count; s++) {
+          output[s] = phase[s] * scale < d ? 1.f : -1.f;
+        }
+      } else {
+        for (int s = 0; s < sample_count; s++) {
+          output[s] = phase[s] * scale < duty->samples[s] ? 1.f : -1.f;
+        }
+      }
+      break;
+    case SHAPE_SINE:
+      for (int s = 0; s < sample_count; s++) {
+        // sin(2 pi x) = -sin(pi u) with u = 2x - 1, folded into [-0.5, 0.5]
+        float u = phase[s] * (2 * scale) - 1;
+        float v = copysignf(0.5f - fabsf(fabsf(u) - 0.5f), u);
+        output[s] = -sin_pi_half(v);
+      }
+      break;
+  }
+}
+
+static void render_oscillator(int shape, uint32_t *phase_state, const Stream *frequency, const Stream *duty, Stream *output, const Block *block) {
+  uint32_t phase[MAX_BLOCK_SIZE];
+  accumulate_phase(phase, phase_state, frequency, block->sample_count, block->sample_rate);
+  render_shape(shape, write_stream(output), phase, duty, block->sample_count);
+}
+
+static uint32_t phase_from_number(double phase) {
+  return (uint32_t) (int64_t) ((phase - floor(phase)) * PHASE_SCALE);
+}
+
+typedef struct {
+  Node node;
+  Stream *output;
+  Stream *input_frequency;
+  Stream *input_duty;
+  uint32_t phase;
+} TriangleNode;
+
+static void triangle_process(Node *node, Block *block) {
+  TriangleNode *triangle = (TriangleNode *) node;
+  render_oscillator(SHAPE_TRIANGLE, &triangle->phase, triangle->input_frequency, triangle->input_duty, triangle->output, block);
+}
+
+static Node *triangle_create(lua_State *L, int n) {
+  TriangleNode *triangle = new_node(L, sizeof(TriangleNode), triangle_process);
+  triangle->output = check_output_field(L, n, "output", &triangle->node);
+  triangle->input_frequency = check_stream_field(L, n, "input_frequency", &triangle->node);
+  triangle->input_duty = check_stream_field(L, n, "input_duty", &triangle->node);
+  triangle->phase = phase_from_number(opt_number_field(L, n, "phase", 0));
+  return &triangle->node;
+}
+
+// a bank runs many oscillators of one shape. the per oscillator state is kept
+// as arrays after the node rather than as an array of structs
+typedef struct {
+  Node node;
+  int shape;
+  int oscillator_count;
+  Stream **outputs;
+  Stream **inputs_frequency;
+  // may be NULL, which means a duty of 0.5 for every oscillator
+  Stream **inputs_duty;
+  uint32_t *phases;
+  void *arrays[];
+} OscillatorBankNode;
+
+static void oscillator_bank_process(Node *node, Block *block) {
+  OscillatorBankNode *bank = (OscillatorBankNode *) node;
+  for (int i = 0; i < bank->oscillator_count; i++) {
+    Stream *duty = bank->inputs_duty ? bank->inputs_duty[i] : NULL;
+    render_oscillator(bank->shape, &bank->phases[i], bank->inputs_frequency[i], duty, bank->outputs[i], block);
+  }
+}
+
+static void check_stream_array_field(lua_State *L, int n, const char *name, Stream **streams, int count, bool output, Node *node) {
+  lua_getfield(L, n, name);
+  luaL_checktype(L, -1, LUA_TTABLE);
+  if ((int) lua_objlen(L, -1) != count) {
+    luaL_error(L, "%s must have one stream per oscillator", name);
+  }
+  for (int i = 0; i < count; i++) {
+    lua_rawgeti(L, -1, i + 1);
+    streams[i] = luaL_checkudata(L, -1, STREAM_TYPE);
+    if (output && !streams[i]->samples) {
+      luaL_error(L, "%s can't contain constant streams", name);
+    }
+    lua_pop(L, 1);
+    node_stream_access(L, node, streams[i], output);
+  }
+  lua_pop(L, 1);
+}
+
+static Node *oscillator_bank_create(lua_State *L, int n) {
+  lua_getfield(L, n, "outputs");
+  luaL_checktype(L, -1, LUA_TTABLE);
+  int count = lua_objlen(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, n, "inputs_duty");
+  bool has_duty = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+
+  size_t size = sizeof(OscillatorBankNode) + count * (3 * sizeof(Stream *) + sizeof(uint32_t));
+  OscillatorBankNode *bank = new_node(L, size, oscillator_bank_process);
+  bank->oscillator_count = count;
+  bank->outputs = (Stream **) bank->arrays;
+  bank->inputs_frequency = bank->outputs + count;
+  bank->inputs_duty = has_duty ? bank->inputs_frequency + count : NULL;
+  bank->phases = (uint32_t *) (bank->inputs_frequency + 2 * count);
+
+  lua_getfield(L, n, "shape");
+  bank->shape = luaL_checkoption(L, -1, "triangle", shape_names);
+  lua_pop(L, 1);
+
+  check_stream_array_field(L, n, "outputs", bank->outputs, count, true, &bank->node);
+  check_stream_array_field(L, n, "inputs_frequency", bank->inputs_frequency, count, false, &bank->node);
+  if (has_duty) {
+    check_stream_array_field(L, n, "inputs_duty", bank->inputs_duty, count, false, &bank->node);
+  }
+  return &bank->node;
+}
+
+enum {
+  ADSR_ATTACK,
+  ADSR_DECAY,
+  ADSR_SUSTAIN,
+  ADSR_RELEASE,
+};
+
+// envelopes run in segments: each stage is a straight line until it reaches
+// its target, so a block is a few linear ramps with no per sample branches.
+// the gate is fixed for the whole call
+typedef struct {
+  int stage;
+  float level;
+  float release_delta;
+} Envelope;
+
+static void envelope_release(Envelope *envelope, float release, double sample_rate) {
+  envelope->stage = ADSR_RELEASE;
+  envelope->release_delta = -envelope->level / maxf(1, release * sample_rate);
+}
+
+// the number of steps of delta from level until it reaches target, at most
+// sample_count
+static int steps_until(float level, float target, float delta, int sample_count) {
+  float steps = ceilf((target - level) / delta);
+  return steps < sample_count ? maxi(0, (int) steps) : sample_count;
+}
+
+static void render_envelope(Envelope *envelope, float attack, float decay, float sustain, float *output, int sample_count, double sample_rate) {
+  float attack_delta = 1 / maxf(1, attack * sample_rate);
+  float decay_delta = -(1 - sustain) / maxf(1, decay * sample_rate);
+  float level = envelope->level;
+  int s = 0;
+  while (s < sample_count) {
+    int remaining = sample_count - s;
+    int count;
+    switch (envelope->stage) {
+      case ADSR_ATTACK:
+        count = steps_until(level, 1, attack_delta, remaining);
+        for (int i = 0; i < count; i++) {
+          output[s + i] = minf(1, level + attack_delta * (i + 1));
+        }
+        if (count < remaining) {
+          level = 1;
+          envelope->stage = ADSR_DECAY;
+        } else {
+          level = output[s + count - 1];
+        }
+        break;
+      case ADSR_DECAY:
+        count = level > sustain ? steps_until(level, sustain, decay_delta, remaining) : 0;
+        for (int i = 0; i < count; i++) {
+          output[s + i] = maxf(sustain, level + decay_delta * (i + 1));
+        }
+        if (count < remaining) {
+          level = sustain;
+          envelope->stage = ADSR_SUSTAIN;
+        } else {
+          level = output[s + count - 1];
+        }
+        break;
+      case ADSR_SUSTAIN:
+        count = remaining;
+        for (int i = 0; i < count; i++) {
+          output[s + i] = level;
+        }
+        break;
+      default:
+        if (level > 0 && envelope->release_delta < 0) {
+          float delta = envelope->release_delta;
+          count = steps_until(level, 0, delta, remaining);
+          for (int i = 0; i < count; i++) {
+            output[s + i] = maxf(0, level + delta * (i + 1));
+          }
+          level = count < remaining ? 0 : output[s + count - 1];
+        } else {
+          count = remaining;
+          level = 0;
+          for (int i = 0; i < count; i++) {
+            output[s + i] = 0;
+          }
+        }
+        break;
+    }
+    s += count;
+  }
+  envelope->level = level;
+}
+
+// the parameters are values so lua can change them between blocks. the gate
+// is either a stream, or queued from lua with adsr_set_gate when there's no
+// input_gate. the envelope is rendered a run of samples at a time between
+// gate changes, and once it has released to 0 the output is a constant 0
+typedef struct {
+  Node node;
+  Stream *output;
+  Stream *input_gate;
+  Value *attack;
+  Value *decay;
+  Value *sustain;
+  Value *release;
+  EventQueue events;
+  Envelope envelope;
+} AdsrNode;
+
+static void adsr_set_gate(AdsrNode *adsr, bool gate, double sample_rate) {
+  Envelope *envelope = &adsr->envelope;
+  if (gate) {
+    if (envelope->stage == ADSR_RELEASE) {
+      envelope->stage = ADSR_ATTACK;
+    }
+  } else if (envelope->stage != ADSR_RELEASE) {
+    envelope_release(envelope, adsr->release->value, sample_rate);
+  }
+}
+
+static void adsr_process(Node *node, Block *block) {
+  AdsrNode *adsr = (AdsrNode *) node;
+  Envelope *envelope = &adsr->envelope;
+  int sample_count = block->sample_count;
+  float attack = adsr->attack->value;
+  float decay = adsr->decay->value;
+  float sustain = adsr->sustain->value;
+
+  const Stream *input_gate = adsr->input_gate;
+  if (!input_gate) {
+    EventQueue *events = &adsr->events;
+    if (!has_events(events, sample_count) && envelope->stage == ADSR_RELEASE && envelope->level <= 0) {
+      write_constant(adsr->output, 0);
+      return;
+    }
+    float *output = write_stream(adsr->output);
+    int e = 0;
+    for (int s = 0; s < sample_count;) {
+      for (; e < events->count && events->events[e].offset <= s; e++) {
+        adsr_set_gate(adsr, events->events[e].value != 0, block->sample_rate);
+      }
+      int end = event_run_end(events, e, sample_count);
+      render_envelope(envelope, attack, decay, sustain, output + s, end - s, block->sample_rate);
+      s = end;
+    }
+    finish_events(events, e, sample_count);
+    return;
+  }
+
+  if (input_gate->constant) {
+    adsr_set_gate(adsr, input_gate->value >= 0.5f, block->sample_rate);
+    if (envelope->stage == ADSR_RELEASE && envelope->level <= 0) {
+      write_constant(adsr->output, 0);
+      return;
+    }
+    render_envelope(envelope, attack, decay, sustain, write_stream(adsr->output), sample_count, block->sample_rate);
+    return;
+  }
+
+  // split the block where the gate changes
+  const float *gate = input_gate->samples;
+  float *output = write_stream(adsr->output);
+  int s = 0;
+  while (s < sample_count) {
+    bool on = gate[s] >= 0.5f;
+    int end = s + 1;
+    while (end < sample_count && (gate[end] >= 0.5f) == on) {
+      end++;
+    }
+    adsr_set_gate(adsr, on, block->sample_rate);
+    render_envelope(envelope, attack, decay, sustain, output + s, end - s, block->sample_rate);
+    s = end;
+  }
+}
+
+static Node *adsr_create(lua_State *L, int n) {
+  AdsrNode *adsr = new_node(L, sizeof(AdsrNode), adsr_process);
+  adsr->output = check_output_field(L, n, "output", &adsr->node);
+  lua_getfield(L, n, "input_gate");
+  bool has_gate = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (has_gate) {
+    adsr->input_gate = check_stream_field(L, n, "input_gate", &adsr->node);
+  }
+  adsr->attack = check_udata_field(L, n, "attack", VALUE_TYPE);
+  adsr->decay = check_udata_field(L, n, "decay", VALUE_TYPE);
+  adsr->sustain = check_udata_field(L, n, "sustain", VALUE_TYPE);
+  adsr->release = check_udata_field(L, n, "release", VALUE_TYPE);
+  adsr->envelope.stage = opt_integer_field(L, n, "stage", ADSR_RELEASE);
+  adsr->envelope.level = opt_number_field(L, n, "value", 0);
+  adsr->envelope.release_delta = opt_number_field(L, n, "release_delta", 0);
+  luaL_argcheck(L, adsr->envelope.stage >= ADSR_ATTACK && adsr->envelope.stage <= ADSR_RELEASE, n, "invalid stage");
+  return &adsr->node;
+}
+
+static AdsrNode *check_adsr(lua_State *L, int n) {
+  Node *node = check_node(L, n);
+  if (node->process != adsr_process) {
+    luaL_error(L, "expected an adsr node");
+  }
+  return (AdsrNode *) node;
+}
+
+// dsp_c.adsr_set_gate(node, gate, offset?) for envelopes without an
+// input_gate
+static int l_adsr_set_gate(lua_State *L) {
+  AdsrNode *adsr = check_adsr(L, 1);
+  bool gate = lua_toboolean(L, 2);
+  push_event(L, &adsr->events, 3)->value = gate;
+  return 0;
+}
+
+// a voice pool is a polyphonic instrument in one node: every voice is an
+// oscillator through an envelope and an optional lowpass, mixed into one
+// output. voice state is kept as arrays after the node and only active voices
+// are processed, so the cost follows the number of notes playing. notes are
+// queued from lua with voice_pool_note_on and voice_pool_note_off, when every
+// voice is busy the oldest or quietest is stolen
+
+enum {
+  STEAL_OLDEST,
+  STEAL_QUIETEST,
+};
+
+static const char *const steal_names[] = { "oldest", "quietest", NULL };
+
+enum {
+  EVENT_NOTE_ON,
+  EVENT_NOTE_OFF,
+};
+
+typedef struct {
+  Node node;
+  Stream *output;
+  int shape;
+  int steal;
+  Value *attack;
+  Value *decay;
+  Value *sustain;
+  Value *release;
+  // lowpass cutoff in hz, or no filter
+  Value *cutoff;
+  EventQueue events;
+  int voice_count;
+  // the voices playing, in no particular order
+  int active_count;
+  int *active;
+  uint64_t note_count;
+  // per voice, a voice is free when it isn't active
+  bool *playing;
+  int *notes;
+  uint64_t *started;
+  uint32_t *phases;
+  uint32_t *increments;
+  float *velocities;
+  float *filter_values;
+  Envelope *envelopes;
+  max_align_t arrays[];
+} VoicePoolNode;
+
+// a free voice if there is one, otherwise the one to steal. released voices
+// are stolen before held ones
+static int choose_voice(VoicePoolNode *pool) {
+  if (pool->active_count < pool->voice_count) {
+    for (int v = 0; v < pool->voice_count; v++) {
+      if (!pool->playing[v]) {
+        pool->playing[v] = true;
+        pool->active[pool->active_count++] = v;
+        return v;
+      }
+    }
+  }
+  int best = pool->active[0];
+  for (int a = 1; a < pool->active_count; a++) {
+    int v = pool->active[a];
+    bool released = pool->envelopes[v].stage == ADSR_RELEASE;
+    bool best_released = pool->envelopes[best].stage == ADSR_RELEASE;
+    if (released != best_released) {
+      if (released) {
+        best = v;
+      }
+      continue;
+    }
+    bool better = pool->steal == STEAL_OLDEST
+      ? pool->started[v] < pool->started[best]
+      : pool->envelopes[v].level < pool->envelopes[best].level;
+    if (better) {
+      best = v;
+    }
+  }
+  return best;
+}
+
+// a stolen voice attacks from its current level so it doesn't click
+static void voice_pool_apply(VoicePoolNode *pool, const Event *event, double sample_rate) {
+  if (event->type == EVENT_NOTE_ON) {
+    int v = choose_voice(pool);
+    pool->notes[v] = event->note;
+    pool->started[v] = ++pool->note_count;
+    pool->increments[v] = phase_increment(event->value, sample_rate);
+    pool->velocities[v] = event->velocity;
+    pool->envelopes[v].stage = ADSR_ATTACK;
+    return;
+  }
+  float release = pool->release->value;
+  for (int a = 0; a < pool->active_count; a++) {
+    int v = pool->active[a];
+    if (pool->notes[v] == event->note && pool->envelopes[v].stage != ADSR_RELEASE) {
+      envelope_release(&pool->envelopes[v], release, sample_rate);
+    }
+  }
+}
+
+// adds sample_count samples of every active voice to output
+static void voice_pool_render(VoicePoolNode *pool, float *output, float alpha, int sample_count, double sample_rate) {
+  float attack = pool->attack->value;
+  float decay = pool->decay->value;
+  float sustain = pool->sustain->value;
+
+  uint32_t phase[MAX_BLOCK_SIZE];
+  float wave[MAX_BLOCK_SIZE];
+  float level[MAX_BLOCK_SIZE];
+  for (int a = 0; a < pool->active_count; a++) {
+    int v = pool->active[a];
+
+    uint32_t start = pool->phases[v];
+    uint32_t increment = pool->increments[v];
+    for (int s = 0; s < sample_count; s++) {
+      phase[s] = start + increment * (uint32_t) (s + 1);
+    }
+    pool->phases[v] = phase[sample_count - 1];
+    render_shape(pool->shape, wave, phase, NULL, sample_count);
+    render_envelope(&pool->envelopes[v], attack, decay, sustain, level, sample_count, sample_rate);
+
+    float velocity = pool->velocities[v];
+    if (pool->cutoff) {
+      float last_value = pool->filter_values[v];
+      for (int s = 0; s < sample_count; s++) {
+        last_value += alpha * (wave[s] - last_value);
+        output[s] += last_value * level[s] * velocity;
+      }
+      pool->filter_values[v] = last_value;
+    } else {
+      for (int s = 0; s < sample_count; s++) {
+        output[s] += wave[s] * level[s] * velocity;
+      }
+    }
+
+    // finished voices swap with the last active one
+    Envelope *envelope = &pool->envelopes[v];
+    if (envelope->stage == ADSR_RELEASE && envelope->level <= 0) {
+      pool->playing[v] = false;
+      pool->active[a--] = pool->active[--pool->active_count];
+    }
+  }
+}
+
+static void voice_pool_process(Node *node, Block *block) {
+  VoicePoolNode *pool = (VoicePoolNode *) node;
+  EventQueue *events = &pool->events;
+  int sample_count = block->sample_count;
+  if (pool->active_count == 0 && !has_events(events, sample_count)) {
+    write_constant(pool->output, 0);
+    return;
+  }
+
+  float *output = write_stream(pool->output);
+  kernels.fill(output, 0, sample_count);
+  float alpha = pool->cutoff ? calculate_filter_coefficient(pool->cutoff->value, block->sample_rate) : 1;
+  int e = 0;
+  for (int s = 0; s < sample_count;) {
+    for (; e < events->count && events->events[e].offset <= s; e++) {
+      voice_pool_apply(pool, &events->events[e], block->sample_rate);
+    }
+    int end = event_run_end(events, e, sample_count);
+    voice_pool_render(pool, output + s, alpha, end - s, block->sample_rate);
+    s = end;
+  }
+  finish_events(events, e, sample_count);
+}
+
+static Node *voice_pool_create(lua_State *L, int n) {
+  int voice_count = check_integer_field(L, n, "voice_count");
+  luaL_argcheck(L, voice_count > 0, n, "voice_count must be positive");
+
+  size_t per_voice = sizeof(int) * 2 + sizeof(bool) + sizeof(uint64_t) + sizeof(uint32_t) * 2 + sizeof(float) * 2 + sizeof(Envelope);
+  VoicePoolNode *pool = new_node(L, sizeof(VoicePoolNode) + voice_count * per_voice, voice_pool_process);
+  pool->voice_count = voice_count;
+  // widest first so every array stays aligned
+  pool->started = (uint64_t *) pool->arrays;
+  pool->envelopes = (Envelope *) (pool->started + voice_count);
+  pool->active = (int *) (pool->envelopes + voice_count);
+  pool->notes = pool->active + voice_count;
+  pool->phases = (uint32_t *) (pool->notes + voice_count);
+  pool->increments = pool->phases + voice_count;
+  pool->velocities = (float *) (pool->increments + voice_count);
+  pool->filter_values = pool->velocities + voice_count;
+  pool->playing = (bool *) (pool->filter_values + voice_count);
+  for (int v = 0; v < voice_count; v++) {
+    pool->envelopes[v].stage = ADSR_RELEASE;
+  }
+
+  pool->output = check_output_field(L, n, "output", &pool->node);
+  pool->attack = check_udata_field(L, n, "attack", VALUE_TYPE);
+  pool->decay = check_udata_field(L, n, "decay", VALUE_TYPE);
+  pool->sustain = check_udata_field(L, n, "sustain", VALUE_TYPE);
+  pool->release = check_udata_field(L, n, "release", VALUE_TYPE);
+  lua_getfield(L, n, "cutoff");
+  pool->cutoff = lua_isnil(L, -1) ? NULL : luaL_checkudata(L, -1, VALUE_TYPE);
+  lua_pop(L, 1);
+  lua_getfield(L, n, "shape");
+  pool->shape = luaL_checkoption(L, -1, "triangle", shape_names);
+  lua_pop(L, 1);
+  lua_getfield(L, n, "steal");
+  pool->steal = luaL_checkoption(L, -1, "oldest", steal_names);
+  lua_pop(L, 1);
+  return &pool->node;
+}
+
+static VoicePoolNode *check_voice_pool(lua_State *L, int n) {
+  Node *node = check_node(L, n);
+  if (node->process != voice_pool_process) {
+    luaL_error(L, "expected a voice pool node");
+  }
+  return (VoicePoolNode *) node;
+}
+
+// dsp_c.voice_pool_note_on(pool, note, frequency, velocity?, offset?)
+static int l_voice_pool_note_on(lua_State *L) {
+  VoicePoolNode *pool = check_voice_pool(L, 1);
+  int note = luaL_checkinteger(L, 2);
+  float frequency = luaL_checknumber(L, 3);
+  float velocity = luaL_optnumber(L, 4, 1);
+  Event *event = push_event(L, &pool->events, 5);
+  event->type = EVENT_NOTE_ON;
+  event->note = note;
+  event->value = frequency;
+  event->velocity = velocity;
+  return 0;
+}
+
+// dsp_c.voice_pool_note_off(pool, note, offset?) releases every voice
+// playing note
+static int l_voice_pool_note_off(lua_State *L) {
+  VoicePoolNode *pool = check_voice_pool(L, 1);
+  int note = luaL_checkinteger(L, 2);
+  Event *event = push_event(L, &pool->events, 3);
+  event->type = EVENT_NOTE_OFF;
+  event->note = note;
+  return 0;
+}
+
+static int l_voice_pool_active_count(lua_State *L) {
+  lua_pushinteger(L, check_voice_pool(L, 1)->active_count);
+  return 1;
+}
+
+// stereo nodes take a left and a right stream, or one stream with 2 channels
+// for both, which is stored as both sides. the right side is read from
+// channel right_channel(left, right)
+static int right_channel(const Stream *left, const Stream *right) {
+  return left == right;
+}
+
+static void check_stereo_fields(lua_State *L, int n, const char *name, Stream **left, Stream **right, bool output, Node *node) {
+  char left_name[32];
+  char right_name[32];
+  snprintf(left_name, sizeof(left_name), "%s_left", name);
+  snprintf(right_name, sizeof(right_name), "%s_right", name);
+  if (has_field(L, n, name)) {
+    Stream *stream = output ? check_output_field(L, n, name, node) : check_stream_field(L, n, name, node);
+    if (stream->channel_count != 2) {
+      luaL_error(L, "%s needs 2 channels", name);
+    }
+    *left = *right = stream;
+  } else if (output) {
+    *left = check_output_field(L, n, left_name, node);
+    *right = check_output_field(L, n, right_name, node);
+  } else {
+    *left = check_stream_field(L, n, left_name, node);
+    *right = check_stream_field(L, n, right_name, node);
+  }
+}
+
+// the divisor jumps to any amplitude above it and otherwise decays towards 1
+// by LIMITER_RELEASE per sample. limiter_recovery[k] is 1 / LIMITER_RELEASE^k,
+// so the gain k samples after a peak is a multiply instead of a division
+#define LIMITER_RELEASE 0.99
+
+static float limiter_recovery[MAX_BLOCK_SIZE + 1];
+
+static void init_limiter_recovery(void) {
+  for (int k = 0; k <= MAX_BLOCK_SIZE; k++) {
+    limiter_recovery[k] = pow(LIMITER_RELEASE, -k);
+  }
+}
+
+// writes the gain for every sample of amplitude and returns the divisor to
+// start the next block with. only samples above the decaying divisor divide
+static double limiter_gain(float *gain, const float *amplitude, double divisor, int sample_count) {
+  float inverse = 1 / divisor;
+  int peak = 0;
+  for (int s = 0; s < sample_count; s++) {
+    float g = minf(1, inverse * limiter_recovery[s - peak]);
+    if (amplitude[s] * g > 1) {
+      inverse = 1 / amplitude[s];
+      peak = s;
+      g = inverse;
+    }
+    gain[s] = g;
+  }
+  return max(1, pow(LIMITER_RELEASE, sample_count - peak) / inverse);
+}
+
+// output[s] = max(input[s], ..., input[s + width - 1]). the width covered
+// doubles every pass until one more would pass it, then two overlapping
+// windows make up the rest, so every pass is a max the compiler vectorizes
+static void window_max(float *restrict output, float *restrict scratch, const float *restrict input, int width, int sample_count) {
+  int valid = sample_count + width - 1;
+  memcpy(scratch, input, valid * sizeof(float));
+  int covered = 1;
+  while (covered * 2 <= width) {
+    valid -= covered;
+    for (int i = 0; i < valid; i++) {
+      scratch[i] = maxf(scratch[i], scratch[i + covered]);
+    }
+    covered *= 2;
+  }
+  for (int s = 0; s < sample_count; s++) {
+    output[s] = maxf(scratch[s], scratch[s + width - covered]);
+  }
+}
+
+// the gain for output sample s is the mean of the held gains of the width
+// samples up to s, held starting width - 1 samples before the block. each of
+// those already covers sample s, so the mean does too, and a drop in the held
+// gain becomes a ramp across the window instead of a step. the clamp only
+// catches rounding
+static void smooth_gain(float *gain, const float *held, const float *amplitude, int width, int sample_count) {
+  double sum = 0;
+  for (int i = 0; i < width - 1; i++) {
+    sum += held[i];
+  }
+  for (int s = 0; s < sample_count; s++) {
+    sum += held[s + width - 1];
+    float g = sum / width;
+    gain[s] = amplitude[s] * g > 1 ? 1 / amplitude[s] : g;
+    sum -= held[s];
+  }
+}
+
+// with lookahead the output is delayed by that many samples, and the gain
+// for each sample already covers the peaks up to lookahead samples after it,
+// so the output never goes over 1. the last lookahead samples of both inputs,
+// their amplitude and the held gain are stored after the node. with output_stereo the
+// limiter interleaves into it instead of writing the output streams, so the
+// main output doesn't need a separate interleave
+typedef struct {
+  Node node;
+  Stream *output_left;
+  Stream *output_right;
+  float *output_stereo;
+  Stream *input_left;
+  Stream *input_right;
+  double divisor;
+  int lookahead;
+  // whether the held gains stored for smoothing haven't all recovered to 1
+  bool ramping;
+  float history[];
+} LimiterNode;
+
+// writes left and right times gain to the outputs, a NULL gain passes them
+// through
+static void limiter_write(LimiterNode *limiter, const float *left, const float *right, const float *gain, int sample_count) {
+  if (limiter->output_stereo) {
+    if (gain) {
+      kernels.scale_interleave(limiter->output_stereo, left, right, gain, sample_count);
+    } else {
+      kernels.interleave(limiter->output_stereo, left, right, sample_count);
+    }
+    return;
+  }
+  float *output_left = write_channel(limiter->output_left, 0);
+  float *output_right = write_channel(limiter->output_right, right_channel(limiter->output_left, limiter->output_right));
+  if (gain) {
+    kernels.scale(output_left, left, gain, sample_count);
+    kernels.scale(output_right, right, gain, sample_count);
+  } else {
+    memcpy(output_left, left, sample_count * sizeof(float));
+    memcpy(output_right, right, sample_count * sizeof(float));
+  }
+}
+
+static void limit_with_lookahead(LimiterNode *limiter, const float *input_left, const float *input_right, Block *block) {
+  int sample_count = block->sample_count;
+  int lookahead = limiter->lookahead;
+  int total = lookahead + sample_count;
+  float *history_left = limiter->history;
+  float *history_right = history_left + lookahead;
+  float *history_amplitude = history_right + lookahead;
+  float *history_gain = history_amplitude + lookahead;
+  float left[2 * MAX_BLOCK_SIZE];
+  float right[2 * MAX_BLOCK_SIZE];
+  float amplitude[2 * MAX_BLOCK_SIZE];
+  memcpy(left, history_left, lookahead * sizeof(float));
+  memcpy(left + lookahead, input_left, sample_count * sizeof(float));
+  memcpy(right, history_right, lookahead * sizeof(float));
+  memcpy(right + lookahead, input_right, sample_count * sizeof(float));
+  memcpy(amplitude, history_amplitude, lookahead * sizeof(float));
+  kernels.amplitude(amplitude + lookahead, input_left, input_right, sample_count);
+
+  // a peak counts in the block it arrives in, not again when it's output
+  if (kernels.peak(input_left, input_right, sample_count) > 1) {
+    block->hit_limiter = true;
+  }
+  float peak = kernels.peak(left, right, total);
+  if (peak <= 1 && limiter->divisor == 1 && !limiter->ramping) {
+    limiter_write(limiter, left, right, NULL, sample_count);
+  } else {
+    float window[MAX_BLOCK_SIZE];
+    float scratch[2 * MAX_BLOCK_SIZE];
+    float held[2 * MAX_BLOCK_SIZE];
+    float gain[MAX_BLOCK_SIZE];
+    window_max(window, scratch, amplitude, lookahead + 1, sample_count);
+    memcpy(held, history_gain, lookahead * sizeof(float));
+    limiter->divisor = limiter_gain(held + lookahead, window, limiter->divisor, sample_count);
+    smooth_gain(gain, held, amplitude, lookahead + 1, sample_count);
+    limiter_write(limiter, left, right, gain, sample_count);
+    memcpy(history_gain, held + sample_count, lookahead * sizeof(float));
+    limiter->ramping = false;
+    for (int i = 0; i < lookahead; i++) {
+      limiter->ramping |= history_gain[i] < 1;
+    }
+  }
+
+  memcpy(history_left, left + sample_count, lookahead * sizeof(float));
+  memcpy(history_right, right + sample_count, lookahead * sizeof(float));
+  memcpy(history_amplitude, amplitude + sample_count, lookahead * sizeof(float));
+}
+
+static void stereo_limiter_process(Node *node, Block *block) {
+  LimiterNode *limiter = (LimiterNode *) node;
+  int sample_count = block->sample_count;
+  float left_scratch[MAX_BLOCK_SIZE];
+  float right_scratch[MAX_BLOCK_SIZE];
+  const float *input_left = read_channel(limiter->input_left, 0, left_scratch, sample_count);
+  const float *input_right = read_channel(limiter->input_right, right_channel(limiter->input_left, limiter->input_right), right_scratch, sample_count);
+  if (limiter->lookahead > 0) {
+    limit_with_lookahead(limiter, input_left, input_right, block);
+    return;
+  }
+
+  // a block that stays under 1 after the divisor has recovered passes
+  // through untouched, constants stay constant
+  float peak = kernels.peak(input_left, input_right, sample_count);
+  if (peak > 1) {
+    block->hit_limiter = true;
+  }
+  if (peak <= 1 && limiter->divisor == 1) {
+    bool constant = limiter->input_left->constant && limiter->input_right->constant;
+    // one stereo output holds a single constant for both channels
+    bool separate = limiter->output_left != limiter->output_right || limiter->input_left->value == limiter->input_right->value;
+    if (!limiter->output_stereo && constant && separate) {
+      write_constant(limiter->output_left, limiter->input_left->value);
+      write_constant(limiter->output_right, limiter->input_right->value);
+    } else {
+      limiter_write(limiter, input_left, input_right, NULL, sample_count);
+    }
+    return;
+  }
+
+  float amplitude[MAX_BLOCK_SIZE];
+  float gain[MAX_BLOCK_SIZE];
+  kernels.amplitude(amplitude, input_left, input_right, sample_count);
+  limiter->divisor = limiter_gain(gain, amplitude, limiter->divisor, sample_count);
+  limiter_write(limiter, input_left, input_right, gain, sample_count);
+}
+
+static Node *stereo_limiter_create(lua_State *L, int n) {
+  int lookahead = opt_integer_field(L, n, "lookahead", 0);
+  luaL_argcheck(L, lookahead >= 0 && lookahead <= MAX_BLOCK_SIZE, n, "lookahead must be between 0 and the max block size");
+  LimiterNode *limiter = new_node(L, sizeof(LimiterNode) + 4 * lookahead * sizeof(float), stereo_limiter_process);
+  for (int i = 0; i < lookahead; i++) {
+    limiter->history[3 * lookahead + i] = 1;
+  }
+  lua_getfield(L, n, "output_stereo");
+  bool interleaved = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (interleaved) {
+    limiter->output_stereo = check_pointer_field(L, n, "output_stereo");
+    node_access(L, &limiter->node, limiter->output_stereo, true);
+  } else {
+    check_stereo_fields(L, n, "output", &limiter->output_left, &limiter->output_right, true, &limiter->node);
+  }
+  check_stereo_fields(L, n, "input", &limiter->input_left, &limiter->input_right, false, &limiter->node);
+  limiter->divisor = max(1, opt_number_field(L, n, "divisor", 1));
+  limiter->lookahead = lookahead;
+  return &limiter->node;
+}
+
+typedef struct {
+  Node node;
+  float *output_stereo;
+  Stream *input_left;
+  Stream *input_right;
+} InterleaveNode;
+
+// sample_count is the number of stereo frames to output
+static void stereo_interleave_process(Node *node, Block *block) {
+  InterleaveNode *interleave = (InterleaveNode *) node;
+  float left_scratch[MAX_BLOCK_SIZE];
+  float right_scratch[MAX_BLOCK_SIZE];
+  int right = right_channel(interleave->input_left, interleave->input_right);
+  const float *input_left = read_channel(interleave->input_left, 0, left_scratch, block->sample_count);
+  const float *input_right = read_channel(interleave->input_right, right, right_scratch, block->sample_count);
+  kernels.interleave(interleave->output_stereo, input_left, input_right, block->sample_count);
+}
+
+static Node *stereo_interleave_create(lua_State *L, int n) {
+  InterleaveNode *interleave = new_node(L, sizeof(InterleaveNode), stereo_interleave_process);
+  interleave->output_stereo = check_pointer_field(L, n, "output_stereo");
+  node_access(L, &interleave->node, interleave->output_stereo, true);
+  check_stereo_fields(L, n, "input", &interleave->input_left, &interleave->input_right, false, &interleave->node);
+  return &interleave->node;
+}
+
+// the delay buffer itself is a node that runs before its writer and readers,
+// the samples are stored after the node. the buffer is a power of two long so
+// indices wrap with a mask, and has room for interpolating past both ends
+typedef struct {
+  Node node;
+  int max_block_size;
+  int max_delay_samples;
+  int buffer_size;
+  int mask;
+  int write_index;
+  // this offset represents delay time 0 *at the start of the buffer duration*
+  int read_index;
+  bool wrote_this_step;
+  float buffer[];
+} DelayBufferNode;
+
+static void delay_buffer_process(Node *node, Block *block) {
+  DelayBufferNode *delay_buffer = (DelayBufferNode *) node;
+  assert(delay_buffer->wrote_this_step); // there must be a writer or else we'd play old samples
+  delay_buffer->wrote_this_step = false;
+  // the read index to *start* reading a stream at
+  // points to the beginning of this step's write (which has not happened yet)
+  delay_buffer->read_index = delay_buffer->write_index;
+}
+
+// cubic interpolation reads up to two samples further back than the delay
+#define DELAY_INTERPOLATION_SAMPLES 2
+
+static Node *delay_buffer_create(lua_State *L, int n) {
+  int min_buffer_size = check_integer_field(L, n, "buffer_size");
+  luaL_argcheck(L, min_buffer_size > 0 && min_buffer_size <= (1 << 30), n, "buffer_size must be positive");
+  int buffer_size = 1;
+  while (buffer_size < min_buffer_size + DELAY_INTERPOLATION_SAMPLES) {
+    buffer_size *= 2;
+  }
+  DelayBufferNode *delay_buffer = new_node(L, sizeof(DelayBufferNode) + buffer_size * sizeof(float), delay_buffer_process);
+  delay_buffer->max_block_size = check_integer_field(L, n, "max_block_size");
+  delay_buffer->max_delay_samples = check_integer_field(L, n, "max_delay_samples");
+  delay_buffer->buffer_size = buffer_size;
+  delay_buffer->mask = buffer_size - 1;
+  delay_buffer->wrote_this_step = true;
+  node_access(L, &delay_buffer->node, delay_buffer, true);
+  return &delay_buffer->node;
+}
+
+static DelayBufferNode *check_delay_buffer_field(lua_State *L, int n, Node *node, bool write) {
+  Node *delay_buffer = check_node_field(L, n, "delay_buffer");
+  if (delay_buffer->process != delay_buffer_process) {
+    luaL_error(L, "expected a delay buffer node");
+  }
+  node_access(L, node, delay_buffer, write);
+  return (DelayBufferNode *) delay_buffer;
+}
+
+typedef struct {
+  Node node;
+  DelayBufferNode *delay_buffer;
+  Stream *input;
+} DelayWriterNode;
+
+// a block is a contiguous run of the buffer that wraps at most once
+static void delay_writer_process(Node *node, Block *block) {
+  DelayWriterNode *writer = (DelayWriterNode *) node;
+  DelayBufferNode *delay_buffer = writer->delay_buffer;
+  int sample_count = block->sample_count;
+  float input_scratch[MAX_BLOCK_SIZE];
+  const float *input = read_stream(writer->input, input_scratch, sample_count);
+  float *buffer = delay_buffer->buffer;
+  int write_index = delay_buffer->write_index;
+  assert(!delay_buffer->wrote_this_step);
+  delay_buffer->wrote_this_step = true;
+
+  int first = mini(sample_count, delay_buffer->buffer_size - write_index);
+  memcpy(buffer + write_index, input, first * sizeof(float));
+  memcpy(buffer, input + first, (sample_count - first) * sizeof(float));
+
+  delay_buffer->write_index = (write_index + sample_count) & delay_buffer->mask;
+}
+
+static Node *delay_writer_create(lua_State *L, int n) {
+  DelayWriterNode *writer = new_node(L, sizeof(DelayWriterNode), delay_writer_process);
+  writer->delay_buffer = check_delay_buffer_field(L, n, &writer->node, true);
+  writer->input = check_stream_field(L, n, "input", &writer->node);
+  return &writer->node;
+}
+
+enum {
+  INTERPOLATION_NONE,
+  INTERPOLATION_LINEAR,
+  INTERPOLATION_CUBIC,
+};
+
+static const char *const interpolation_names[] = { "none", "linear", "cubic", NULL };
+
+typedef struct {
+  Node node;
+  DelayBufferNode *delay_buffer;
+  Stream *output;
+  Stream *input_delay_time;
+  int interpolation;
+} DelayReaderNode;
+
+static void delay_reader_process(Node *node, Block *block) {
+  DelayReaderNode *reader = (DelayReaderNode *) node;
+  DelayBufferNode *delay_buffer = reader->delay_buffer;
+  int sample_count = block->sample_count;
+  float *output = write_stream(reader->output);
+  const float *buffer = delay_buffer->buffer;
+  int mask = delay_buffer->mask;
+  int read_index = delay_buffer->read_index;
+  // this is the minimum amount a delay can be, cubic interpolation also
+  // reads one sample newer than the delay
+  int min_delay_samples = delay_buffer->wrote_this_step ? 0 : delay_buffer->max_block_size;
+  if (reader->interpolation == INTERPOLATION_CUBIC) {
+    min_delay_samples++;
+  }
+  float min_delay = min_delay_samples;
+  float max_delay = maxi(min_delay_samples, delay_buffer->max_delay_samples);
+  int interpolation = reader->interpolation;
+
+  if (reader->input_delay_time->constant) {
+    float delay = minf(max_delay, maxf(min_delay, reader->input_delay_time->value * block->sample_rate));
+    if (interpolation == INTERPOLATION_NONE || delay == floorf(delay)) {
+      // a fixed delay reads a contiguous run, which wraps at most once
+      int index = (read_index - (int)(delay + 0.5f)) & mask;
+      int first = mini(sample_count, delay_buffer->buffer_size - index);
+      memcpy(output, buffer + index, first * sizeof(float));
+      memcpy(output + first, buffer, (sample_count - first) * sizeof(float));
+      return;
+    }
+  }
+
+  float delay_scratch[MAX_BLOCK_SIZE];
+  const float *input_delay_time = read_stream(reader->input_delay_time, delay_scratch, sample_count);
+  switch (interpolation) {
+    case INTERPOLATION_NONE:
+      for (int s = 0; s < sample_count; s++) {
+        float delay = minf(max_delay, maxf(min_delay, input_delay_time[s] * block->sample_rate));
+        output[s] = buffer[(read_index + s - (int)(delay + 0.5f)) & mask];
+      }
+      break;
+    case INTERPOLATION_LINEAR:
+      for (int s = 0; s < sample_count; s++) {
+        float delay = minf(max_delay, maxf(min_delay, input_delay_time[s] * block->sample_rate));
+        int whole = (int) delay;
+        float t = delay - whole;
+        int index = read_index + s - whole;
+        float y0 = buffer[index & mask];
+        float y1 = buffer[(index - 1) & mask];
+        output[s] = y0 + (y1 - y0) * t;
+      }
+      break;
+    case INTERPOLATION_CUBIC:
+      // catmull-rom through the sample newer than the delay and the two older
+      for (int s = 0; s < sample_count; s++) {
+        float delay = minf(max_delay, maxf(min_delay, input_delay_time[s] * block->sample_rate));
+        int whole = (int) delay;
+        float t = delay - whole;
+        int index = read_index + s - whole;
+        float ym1 = buffer[(index + 1) & mask];
+        float y0 = buffer[index & mask];
+        float y1 = buffer[(index - 1) & mask];
+        float y2 = buffer[(index - 2) & mask];
+        float c1 = 0.5f * (y1 - ym1);
+        float c2 = ym1 - 2.5f * y0 + 2.f * y1 - 0.5f * y2;
+        float c3 = 0.5f * (y2 - ym1) + 1.5f * (y0 - y1);
+        output[s] = ((c3 * t + c2) * t + c1) * t + y0;
+      }
+      break;
+  }
+
+  // note: do not write back read_index
+}
+
+static Node *delay_reader_create(lua_State *L, int n) {
+  DelayReaderNode *reader = new_node(L, sizeof(DelayReaderNode), delay_reader_process);
+  reader->delay_buffer = check_delay_buffer_field(L, n, &reader->node, false);
+  reader->output = check_output_field(L, n, "output", &reader->node);
+  reader->input_delay_time = check_stream_field(L, n, "input_delay_time", &reader->node);
+  lua_getfield(L, n, "interpolation");
+  reader->interpolation = luaL_checkoption(L, -1, "none", interpolation_names);
+  lua_pop(L, 1);
+  return &reader->node;
+}
+
+// every noise node gets its own generator state, so noise nodes don't share
+// anything and can run on any thread. nodes without a seed take consecutive
+// jumps from one default sequence, so a patch sounds the same every run as
+// long as its noise nodes are created in the same order
+static uint64_t noise_sequence[2];
+
+static void seed_noise(NoiseState *state, uint64_t lane[2]) {
+  for (int l = 0; l < NOISE_LANES; l++) {
+    state->s0[l] = lane[0];
+    state->s1[l] = lane[1];
+    xoroshiro128plus_jump(lane);
+  }
+}
+
+static void init_noise_state(lua_State *L, int n, NoiseState *state) {
+  lua_getfield(L, n, "seed");
+  if (lua_isnil(L, -1)) {
+    seed_noise(state, noise_sequence);
+  } else {
+    uint64_t lane[2];
+    xoroshiro128plus_seed_from(lane, (uint64_t) luaL_checkinteger(L, -1));
+    seed_noise(state, lane);
+  }
+  lua_pop(L, 1);
+}
+
+typedef struct {
+  Node node;
+  Stream *output;
+  NoiseState state;
+} WhiteNoiseNode;
+
+static void white_noise_process(Node *node, Block *block) {
+  WhiteNoiseNode *noise = (WhiteNoiseNode *) node;
+  kernels.noise(write_stream(noise->output), &noise->state, block->sample_count);
+}
+
+static Node *white_noise_create(lua_State *L, int n) {
+  WhiteNoiseNode *noise = new_node(L, sizeof(WhiteNoiseNode), white_noise_process);
+  noise->output = check_output_field(L, n, "output", &noise->node);
+  init_noise_state(L, n, &noise->state);
+  return &noise->node;
+}
+
+typedef struct {
+  Node node;
+  Stream *output;
+  NoiseState state;
+  double b0, b1, b2, b3, b4, b5, b6;
+} PinkNoiseNode;
+
+static void pink_noise_process(Node *node, Block *block) {
+  PinkNoiseNode *noise = (PinkNoiseNode *) node;
+  float *output = write_stream(noise->output);
+  double b0 = noise->b0;
+  double b1 = noise->b1;
+  double b2 = noise->b2;
+  double b3 = noise->b3;
+  double b4 = noise->b4;
+  double b5 = noise->b5;
+  double b6 = noise->b6;
+
+  // the white noise is generated up front, only the filter is serial
+  kernels.noise(output, &noise->state, block->sample_count);
+
+  for (int s = 0; s < block->sample_count; s++) {
+    float white = output[s];
+    b0 = 0.99886f * b0 + white * 0.0555179f;
+    b1 = 0.99332f * b1 + white * 0.0750759f;
+    b2 = 0.96900f * b2 + white * 0.1538520f;
+    b3 = 0.86650f * b3 + white * 0.3104856f;
+    b4 = 0.55000f * b4 + white * 0.5329522f;
+    b5 = -0.7616f * b5 - white * 0.0168980f;
+    output[s] = b0 + b1 + b2 + b3 + b4 + b5 + b6 + white * 0.5362f;
+    b6 = white * 0.115926f;
+  }
+
+  noise->b0 = b0;
+  noise->b1 = b1;
+  noise->b2 = b2;
+  noise->b3 = b3;
+  noise->b4 = b4;
+  noise->b5 = b5;
+  noise->b6 = b6;
+}
+
+static Node *pink_noise_create(lua_State *L, int n) {
+  PinkNoiseNode *noise = new_node(L, sizeof(PinkNoiseNode), pink_noise_process);
+  noise->output = check_output_field(L, n, "output", &noise->node);
+  init_noise_state(L, n, &noise->state);
+  return &noise->node;
+}
+
+// convolution
+//
+// convolvers run long impulse responses with uniformly partitioned
+// overlap-save: the input is cut into partitions of partition_size samples,
+// each transformed once over the last two partitions into a history of
+// spectra shared by every impulse response of the node. each impulse response
+// is cut into partitions the same way, and its output for a partition is the
+// sum of the history times its spectra, transformed back. the output is
+// partition_size samples late
+//
+// spectra are the partition_size + 1 bins of a real transform of twice the
+// partition size, stored as the real parts followed by the imaginary parts so
+// the multiply-accumulate over bins is a loop the compiler vectorizes
+
+// the tables of a complex transform of size points, and the twiddles that
+// turn it into a real transform of twice that
+typedef struct {
+  int size;
+  int *reversed;
+  float *twiddle_re;
+  float *twiddle_im;
+  float *split_re;
+  float *split_im;
+} Fft;
+
+static void init_fft(Fft *fft, int size) {
+  int bits = 0;
+  while ((1 << bits) < size) {
+    bits++;
+  }
+  for (int i = 0; i < size; i++) {
+    int reversed = 0;
+    for (int b = 0; b < bits; b++) {
+      reversed |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    fft->reversed[i] = reversed;
+  }
+  for (int k = 0; k < size / 2; k++) {
+    fft->twiddle_re[k] = cos(2 * PI * k / size);
+    fft->twiddle_im[k] = -sin(2 * PI * k / size);
+  }
+  for (int k = 0; k <= size; k++) {
+    fft->split_re[k] = cos(PI * k / size);
+    fft->split_im[k] = -sin(PI * k / size);
+  }
+  fft->size = size;
+}
+
+// in place and unscaled, the inverse uses conjugate twiddles
+static void fft_complex(const Fft *fft, float *re, float *im, bool inverse) {
+  int size = fft->size;
+  for (int i = 0; i < size; i++) {
+    int j = fft->reversed[i];
+    if (i < j) {
+      float t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+  for (int half = 1; half < size; half *= 2) {
+    int step = size / (2 * half);
+    for (int start = 0; start < size; start += 2 * half) {
+      for (int k = 0; k < half; k++) {
+        float wr = fft->twiddle_re[k * step];
+        float wi = inverse ? -fft->twiddle_im[k * step] : fft->twiddle_im[k * step];
+        int a = start + k;
+        int b = a + half;
+        float tr = re[b] * wr - im[b] * wi;
+        float ti = re[b] * wi + im[b] * wr;
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
+
+// the spectrum of 2 * size real samples, from a complex transform of the
+// even samples as real parts and the odd ones as imaginary parts. re and im
+// hold size + 1 bins
+static void fft_real(const Fft *fft, const float *input, float *re, float *im) {
+  int size = fft->size;
+  for (int k = 0; k < size; k++) {
+    re[k] = input[2 * k];
+    im[k] = input[2 * k + 1];
+  }
+  fft_complex(fft, re, im, false);
+  re[size] = re[0];
+  im[size] = im[0];
+  for (int k = 0; k <= size / 2; k++) {
+    int j = size - k;
+    // the transforms of the even and odd samples at k
+    float even_re = (re[k] + re[j]) / 2;
+    float even_im = (im[k] - im[j]) / 2;
+    float odd_re = (im[k] + im[j]) / 2;
+    float odd_im = (re[j] - re[k]) / 2;
+    float wr = fft->split_re[k];
+    float wi = fft->split_im[k];
+    float twisted_re = odd_re * wr - odd_im * wi;
+    float twisted_im = odd_re * wi + odd_im * wr;
+    re[k] = even_re + twisted_re;
+    im[k] = even_im + twisted_im;
+    re[j] = even_re - twisted_re;
+    im[j] = twisted_im - even_im;
+  }
+}
+
+// the inverse of fft_real scaled by size, re and im are overwritten
+static void fft_real_inverse(const Fft *fft, float *re, float *im, float *output) {
+  int size = fft->size;
+  for (int k = 0; k <= size / 2; k++) {
+    int j = size - k;
+    float even_re = (re[k] + re[j]) / 2;
+    float even_im = (im[k] - im[j]) / 2;
+    float difference_re = (re[k] - re[j]) / 2;
+    float difference_im = (im[k] + im[j]) / 2;
+    float wr = fft->split_re[k];
+    float wi = -fft->split_im[k];
+    float odd_re = difference_re * wr - difference_im * wi;
+    float odd_im = difference_re * wi + difference_im * wr;
+    re[k] = even_re - odd_im;
+    im[k] = even_im + odd_re;
+    if (j < size) {
+      re[j] = even_re + odd_im;
+      im[j] = odd_re - even_im;
+    }
+  }
+  fft_complex(fft, re, im, true);
+  for (int k = 0; k < size; k++) {
+    output[2 * k] = re[k];
+    output[2 * k + 1] = im[k];
+  }
+}
+
+// impulse responses come from lua arrays or from files, which are mapped
+// instead of read so a long one is transformed a partition at a time
+// straight out of the page cache. files are 32 bit float wavs, whose first
+// channel is used, or raw mono 32 bit floats
+typedef struct {
+  const uint8_t *mapping;
+  size_t mapping_size;
+  const uint8_t *samples;
+  int stride;
+  int length;
+} ImpulseFile;
+
+static uint32_t read_u32(const uint8_t *bytes) {
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+// finds the samples of a mapped wav, returns an error or NULL
+static const char *find_wav_samples(ImpulseFile *file) {
+  const uint8_t *data = file->mapping;
+  size_t size = file->mapping_size;
+  int channel_count = 0;
+  for (size_t offset = 12; offset + 8 <= size;) {
+    uint32_t chunk_size = read_u32(data + offset + 4);
+    const uint8_t *chunk = data + offset + 8;
+    if (chunk_size > size - offset - 8) {
+      chunk_size = size - offset - 8;
+    }
+    if (memcmp(data + offset, "fmt ", 4) == 0 && chunk_size >= 16) {
+      int format = chunk[0] | chunk[1] << 8;
+      int bits = chunk[14] | chunk[15] << 8;
+      // extensible formats say float in their subformat, the bits are enough
+      if ((format != 3 && format != 0xfffe) || bits != 32) {
+        return "impulse responses need 32 bit float samples";
+      }
+      channel_count = chunk[2] | chunk[3] << 8;
+    } else if (memcmp(data + offset, "data", 4) == 0) {
+      if (channel_count < 1) {
+        return "wav has no fmt chunk before its data";
+      }
+      file->samples = chunk;
+      file->stride = channel_count * sizeof(float);
+      file->length = chunk_size / file->stride;
+      return NULL;
+    }
+    offset += 8 + chunk_size + (chunk_size & 1);
+  }
+  return "wav has no data";
+}
+
+static void close_impulse_file(ImpulseFile *file) {
+  if (!file->mapping) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(file->mapping);
+#else
+  munmap((void *) file->mapping, file->mapping_size);
+#endif
+  file->mapping = NULL;
+}
+
+// returns an error or NULL, the file only needs closing when it opened
+static const char *open_impulse_file(const char *path, ImpulseFile *file) {
+  memset(file, 0, sizeof(ImpulseFile));
+#ifdef _WIN32
+  HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return "can't open file";
+  }
+  LARGE_INTEGER size;
+  HANDLE mapping = NULL;
+  if (GetFileSizeEx(handle, &size) && size.QuadPart > 0) {
+    mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  }
+  CloseHandle(handle);
+  if (!mapping) {
+    return "can't map file";
+  }
+  // the view keeps the mapping open
+  file->mapping = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!file->mapping) {
+    return "can't map file";
+  }
+  file->mapping_size = size.QuadPart;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return "can't open file";
+  }
+  struct stat info;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return "can't map file";
+  }
+  file->mapping = mapping;
+  file->mapping_size = info.st_size;
+#endif
+  if (file->mapping_size >= 12 && memcmp(file->mapping, "RIFF", 4) == 0 && memcmp(file->mapping + 8, "WAVE", 4) == 0) {
+    const char *error = find_wav_samples(file);
+    if (error) {
+      close_impulse_file(file);
+    }
+    return error;
+  }
+  file->samples = file->mapping;
+  file->stride = sizeof(float);
+  file->length = file->mapping_size / sizeof(float);
+  return NULL;
+}
+
+typedef struct {
+  Stream *output;
+  int partition_count;
+  float *spectra;
+  // the output for the partition being filled
+  float *result;
+} Convolution;
+
+typedef struct {
+  Node node;
+  Stream *input;
+  int partition_size;
+  // the spectra in history, enough for the longest impulse response
+  int history_length;
+  // where the newest spectrum is
+  int history_position;
+  float *history;
+  // the last partition of input, then the one being filled
+  float *window;
+  int fill;
+  // partitions in a row whose input was silent, once the history has only
+  // silence the outputs are silent too
+  int quiet;
+  Fft fft;
+  int convolution_count;
+  Convolution convolutions[];
+} ConvolverNode;
+
+static int spectrum_size(const ConvolverNode *convolver) {
+  return 2 * (convolver->partition_size + 1);
+}
+
+// out += a * b over the bins of two spectra
+static void multiply_spectra(float *restrict out, const float *restrict a, const float *restrict b, int bins) {
+  const float *a_im = a + bins;
+  const float *b_im = b + bins;
+  float *restrict out_im = out + bins;
+  for (int k = 0; k < bins; k++) {
+    out[k] += a[k] * b[k] - a_im[k] * b_im[k];
+    out_im[k] += a[k] * b_im[k] + a_im[k] * b[k];
+  }
+}
+
+// transforms the window into the history and works out every output for the
+// next partition
+static void convolve_partition(ConvolverNode *convolver) {
+  int size = convolver->partition_size;
+  int bins = size + 1;
+  float peak = kernels.peak(convolver->window + size, convolver->window + size, size);
+  convolver->quiet = peak == 0 ? mini(convolver->quiet + 1, INT32_MAX / 2) : 0;
+  // the first quiet partition is still in the window, after that the new
+  // spectra are silent and once they fill the history so are the outputs
+  if (convolver->quiet > convolver->history_length + 1) {
+    return;
+  }
+
+  convolver->history_position = (convolver->history_position + 1) % convolver->history_length;
+  float *newest = convolver->history + convolver->history_position * spectrum_size(convolver);
+  fft_real(&convolver->fft, convolver->window, newest, newest + bins);
+  memcpy(convolver->window, convolver->window + size, size * sizeof(float));
+
+  for (int i = 0; i < convolver->convolution_count; i++) {
+    Convolution *convolution = &convolver->convolutions[i];
+    float sum[2 * (MAX_BLOCK_SIZE + 1)];
+    memset(sum, 0, 2 * bins * sizeof(float));
+    int slot = convolver->history_position;
+    for (int p = 0; p < convolution->partition_count; p++) {
+      multiply_spectra(sum, convolver->history + slot * spectrum_size(convolver), convolution->spectra + p * spectrum_size(convolver), bins);
+      slot = slot == 0 ? convolver->history_length - 1 : slot - 1;
+    }
+    // overlap-save keeps the second half, the first wrapped around
+    float output[2 * MAX_BLOCK_SIZE];
+    fft_real_inverse(&convolver->fft, sum, sum + bins, output);
+    memcpy(convolution->result, output + size, size * sizeof(float));
+  }
+}
+
+static void convolver_process(Node *node, Block *block) {
+  ConvolverNode *convolver = (ConvolverNode *) node;
+  int sample_count = block->sample_count;
+  int size = convolver->partition_size;
+  if (is_silent(convolver->input) && convolver->quiet > convolver->history_length + 1) {
+    for (int i = 0; i < convolver->convolution_count; i++) {
+      write_constant(convolver->convolutions[i].output, 0);
+    }
+    int filled = convolver->fill + sample_count;
+    convolver->fill = filled % size;
+    convolver->quiet = mini(convolver->quiet + filled / size, INT32_MAX / 2);
+    return;
+  }
+
+  float scratch[MAX_BLOCK_SIZE];
+  const float *input = read_stream(convolver->input, scratch, sample_count);
+  // a burst too short to fill a partition still has to be transformed, so
+  // the fast path waits until convolve_partition has seen it
+  if (kernels.peak(input, input, sample_count) != 0) {
+    convolver->quiet = 0;
+  }
+  for (int i = 0; i < convolver->convolution_count; i++) {
+    write_stream(convolver->convolutions[i].output);
+  }
+  for (int offset = 0; offset < sample_count;) {
+    int count = mini(size - convolver->fill, sample_count - offset);
+    memcpy(convolver->window + size + convolver->fill, input + offset, count * sizeof(float));
+    for (int i = 0; i < convolver->convolution_count; i++) {
+      Convolution *convolution = &convolver->convolutions[i];
+      memcpy(convolution->output->samples + offset, convolution->result + convolver->fill, count * sizeof(float));
+    }
+    convolver->fill += count;
+    offset += count;
+    if (convolver->fill == size) {
+      convolver->fill = 0;
+      convolve_partition(convolver);
+    }
+  }
+}
+
+// the length of the impulse response at index i of the table at n, checking
+// it without keeping anything open
+static int impulse_length(lua_State *L, int n, int i) {
+  lua_rawgeti(L, n, i + 1);
+  int length;
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    const char *path = lua_tostring(L, -1);
+    ImpulseFile file;
+    const char *error = open_impulse_file(path, &file);
+    if (error) {
+      luaL_error(L, "%s: %s", path, error);
+    }
+    length = file.length;
+    close_impulse_file(&file);
+  } else {
+    luaL_checktype(L, -1, LUA_TTABLE);
+    length = lua_objlen(L, -1);
+    for (int s = 1; s <= length; s++) {
+      lua_rawgeti(L, -1, s);
+      if (!lua_isnumber(L, -1)) {
+        luaL_error(L, "impulse response %d has a sample that isn't a number", i + 1);
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  return length;
+}
+
+// transforms the partitions of the impulse response at index i of the table
+// at n into the convolution's spectra, the 1 / size of the inverse transform
+// is folded in. nothing here raises errors, so a file can't be left open
+static void load_impulse(lua_State *L, int n, int i, ConvolverNode *convolver, Convolution *convolution) {
+  int size = convolver->partition_size;
+  int bins = size + 1;
+  lua_rawgeti(L, n, i + 1);
+  ImpulseFile file = { 0 };
+  bool from_file = lua_type(L, -1) == LUA_TSTRING;
+  int length;
+  if (from_file) {
+    // it could have changed since impulse_length, the spectra have room for
+    // what was there then
+    if (open_impulse_file(lua_tostring(L, -1), &file)) {
+      file.length = 0;
+    }
+    length = mini(file.length, convolution->partition_count * size);
+  } else {
+    length = mini(lua_objlen(L, -1), convolution->partition_count * size);
+  }
+
+  float partition[2 * MAX_BLOCK_SIZE];
+  for (int p = 0; p < convolution->partition_count; p++) {
+    memset(partition, 0, sizeof(partition));
+    int count = mini(size, length - p * size);
+    for (int s = 0; s < count; s++) {
+      int index = p * size + s;
+      if (from_file) {
+        memcpy(&partition[s], file.samples + (size_t) index * file.stride, sizeof(float));
+      } else {
+        lua_rawgeti(L, -1, index + 1);
+        partition[s] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+      }
+    }
+    float *spectrum = convolution->spectra + p * 2 * bins;
+    fft_real(&convolver->fft, partition, spectrum, spectrum + bins);
+    for (int k = 0; k < 2 * bins; k++) {
+      spectrum[k] /= size;
+    }
+  }
+  close_impulse_file(&file);
+  lua_pop(L, 1);
+}
+
+static Node *convolver_create(lua_State *L, int n) {
+  // blocks shorter than the smallest partition are fine, the output is just
+  // written in pieces of them
+  int size = 16;
+  while (size * 2 <= engine_block_size && size < 512) {
+    size *= 2;
+  }
+  size = opt_integer_field(L, n, "partition_size", size);
+  luaL_argcheck(L, size >= 16 && size <= MAX_BLOCK_SIZE && (size & (size - 1)) == 0, n, "partition_size must be a power of two from 16 to 2048");
+  int bins = size + 1;
+
+  lua_getfield(L, n, "impulse_responses");
+  luaL_checktype(L, -1, LUA_TTABLE);
+  int impulses = lua_gettop(L);
+  int count = lua_objlen(L, impulses);
+  lua_getfield(L, n, "outputs");
+  luaL_checktype(L, -1, LUA_TTABLE);
+  if ((int) lua_objlen(L, -1) != count) {
+    luaL_error(L, "needs an output for each impulse response");
+  }
+  lua_pop(L, 1);
+  luaL_argcheck(L, count >= 1 && count <= 64, n, "needs 1 to 64 impulse responses");
+
+  // everything is stored after the node, so it's sized up front
+  int partition_counts[64];
+  int history_length = 1;
+  size_t spectra_size = 0;
+  for (int i = 0; i < count; i++) {
+    int length = impulse_length(L, impulses, i);
+    partition_counts[i] = length > 0 ? (length + size - 1) / size : 1;
+    history_length = partition_counts[i] > history_length ? partition_counts[i] : history_length;
+    spectra_size += (size_t) partition_counts[i] * 2 * bins;
+  }
+  size_t float_count = 2 * size + (size_t) history_length * 2 * bins + spectra_size + (size_t) count * size + size + 2 * bins;
+  size_t node_size = sizeof(ConvolverNode) + count * sizeof(Convolution) + float_count * sizeof(float) + size * sizeof(int);
+  ConvolverNode *convolver = new_node(L, node_size, convolver_process);
+  convolver->input = check_stream_field(L, n, "input", &convolver->node);
+  check_channel_count(L, convolver->input, 1, "input");
+  convolver->partition_size = size;
+  convolver->history_length = history_length;
+  convolver->convolution_count = count;
+
+  float *floats = (float *) &convolver->convolutions[count];
+  convolver->window = floats;
+  floats += 2 * size;
+  convolver->history = floats;
+  floats += (size_t) history_length * 2 * bins;
+  convolver->fft.twiddle_re = floats;
+  convolver->fft.twiddle_im = floats + size / 2;
+  floats += size;
+  convolver->fft.split_re = floats;
+  convolver->fft.split_im = floats + bins;
+  floats += 2 * bins;
+  Stream *outputs[64];
+  check_stream_array_field(L, n, "outputs", outputs, count, true, &convolver->node);
+  for (int i = 0; i < count; i++) {
+    Convolution *convolution = &convolver->convolutions[i];
+    convolution->output = outputs[i];
+    check_channel_count(L, outputs[i], 1, "outputs");
+    convolution->partition_count = partition_counts[i];
+    convolution->result = floats;
+    floats += size;
+    convolution->spectra = floats;
+    floats += (size_t) partition_counts[i] * 2 * bins;
+  }
+  convolver->fft.reversed = (int *) floats;
+  init_fft(&convolver->fft, size);
+
+  for (int i = 0; i < count; i++) {
+    load_impulse(L, impulses, i, convolver, &convolver->convolutions[i]);
+  }
+  return &convolver->node;
+}
+
+// function nodes call back into lua, for anything that isn't a kernel
+typedef struct {
+  Node node;
+  int ref;
+} FunctionNode;
+
+static void function_process(Node *node, Block *block) {
+  FunctionNode *function = (FunctionNode *) node;
+  lua_rawgeti(block->L, LUA_REGISTRYINDEX, function->ref);
+  lua_call(block->L, 0, 0);
+}
+
+static Node *function_create(lua_State *L, int n) {
+  luaL_checktype(L, n, LUA_TFUNCTION);
+  FunctionNode *function = new_node(L, sizeof(FunctionNode), function_process);
+  lua_pushvalue(L, n);
+  function->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return &function->node;
+}
+
+static void function_destroy(lua_State *L, Node *node) {
+  luaL_unref(L, LUA_REGISTRYINDEX, ((FunctionNode *) node)->ref);
+}
+
+// subgraphs run a graph, so they come after graphs
+static Node *subgraph_create(lua_State *L, int n);
+
+static const NodeKind node_kinds[] = {
+  { "set", set_create },
+  { "add", add_create },
+  { "multiply", multiply_create },
+  { "lowpass", lowpass_create },
+  { "highpass", highpass_create },
+  { "triangle", triangle_create },
+  { "oscillator_bank", oscillator_bank_create },
+  { "adsr", adsr_create },
+  { "stereo_limiter", stereo_limiter_create },
+  { "stereo_interleave", stereo_interleave_create },
+  { "delay_buffer", delay_buffer_create },
+  { "delay_writer", delay_writer_create },
+  { "delay_reader", delay_reader_create },
+  { "white_noise", white_noise_create },
+  { "pink_noise", pink_noise_create },
+  { "voice_pool", voice_pool_create },
+  { "convolver", convolver_create },
+  { "subgraph", subgraph_create, NULL, true },
+  { "function", function_create, function_destroy, true },
+  { NULL, NULL }
+};
+
+// dsp_c.new_<kind>(state), the kind is the upvalue
+static int l_new_node(lua_State *L) {
+  const NodeKind *kind = lua_touserdata(L, lua_upvalueindex(1));
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+  Node *node = kind->create(L, 1);
+  node->kind = kind;
+  if (lua_istable(L, 1)) {
+    lua_pushvalue(L, 1);
+    lua_setfenv(L, -2);
+  }
+  return 1;
+}
+
+// dsp_c.<kind>(node, sample_count), the kind is the upvalue. returns whether
+// the node hit a limiter
+static int l_process_node(lua_State *L) {
+  const NodeKind *kind = lua_touserdata(L, lua_upvalueindex(1));
+  Node *node = check_node(L, 1);
+  if (node->kind != kind) {
+    return luaL_error(L, "expected a %s node, got %s", kind->name, node->kind->name);
+  }
+  Block block = { L, check_sample_count(L, 2), .sample_rate = engine_sample_rate };
+  node->process(node, &block);
+  lua_pushboolean(L, block.hit_limiter);
+  return 1;
+}
+
+static int l_node_gc(lua_State *L) {
+  Node *node = check_node(L, 1);
+  if (node->kind && node->kind->destroy) {
+    node->kind->destroy(L, node);
+  }
+  for (int i = 0; i < node->access_count; i++) {
+    if (node->accesses[i].stream) {
+      ((Stream *) node->accesses[i].resource)->access_count--;
+    }
+  }
+  free(node->accesses);
+  node->accesses = NULL;
+  node->access_count = 0;
+  return 0;
+}
+
+// profiling
+//
+// with profiling on, graphs time every node they run and push one record per
+// node per block into a lock-free ring, plus one for the whole block. off, it
+// costs a branch per node. the ring has one producer and one consumer, so
+// only one thread should run graphs while profiling and one lua state, usually
+// the main thread's, drains it with dsp_c.read_profile
+
+#define PROFILE_RING_SIZE (1 << 16)
+
+typedef struct {
+  // 0 for a whole block
+  int node_id;
+  const NodeKind *kind;
+  uint32_t nanoseconds;
+  // samples in the block, only for whole blocks
+  uint32_t sample_count;
+} ProfileRecord;
+
+static ProfileRecord profile_ring[PROFILE_RING_SIZE];
+static shared_int profile_write = 0;
+static shared_int profile_read = 0;
+static shared_int profile_dropped = 0;
+static shared_int profile_enabled = 0;
+
+// nanoseconds on a monotonic clock
+static uint64_t get_nanoseconds(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  if (!frequency.QuadPart) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (uint64_t) ((double) counter.QuadPart * 1e9 / frequency.QuadPart);
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static inline void run_node(Node *node, Block *block) {
+  if (block->profile) {
+    uint64_t start = get_nanoseconds();
+    node->process(node, block);
+    node->profile_nanoseconds += get_nanoseconds() - start;
+  } else {
+    node->process(node, block);
+  }
+}
+
+// only the producer writes profile_write, so the records can be filled in
+// before publishing them all at once
+static void push_profile(Node **nodes, int node_count, uint64_t nanoseconds, int sample_count) {
+  int write = SHARED_LOAD(profile_write);
+  int free_count = PROFILE_RING_SIZE - 1 - ((write - SHARED_LOAD(profile_read)) & (PROFILE_RING_SIZE - 1));
+  if (free_count < node_count + 1) {
+    SHARED_STORE(profile_dropped, SHARED_LOAD(profile_dropped) + 1);
+    for (int i = 0; i < node_count; i++) {
+      nodes[i]->profile_nanoseconds = 0;
+    }
+    return;
+  }
+  for (int i = 0; i < node_count; i++) {
+    Node *node = nodes[i];
+    profile_ring[write] = (ProfileRecord) { node->id, node->kind, (uint32_t) node->profile_nanoseconds, 0 };
+    node->profile_nanoseconds = 0;
+    write = (write + 1) & (PROFILE_RING_SIZE - 1);
+  }
+  profile_ring[write] = (ProfileRecord) { 0, NULL, (uint32_t) nanoseconds, (uint32_t) sample_count };
+  write = (write + 1) & (PROFILE_RING_SIZE - 1);
+  SHARED_STORE(profile_write, write);
+}
+
+static int l_set_profiling(lua_State *L) {
+  SHARED_STORE(profile_enabled, lua_toboolean(L, 1));
+  return 0;
+}
+
+// adds to the { nanoseconds, calls } entry at t[key], expects t, key and
+// t[key] on the stack and pops them
+static void add_profile_entry(lua_State *L, uint32_t nanoseconds, const char *kind) {
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 3);
+    lua_pushvalue(L, -1);
+    lua_insert(L, -3);
+    lua_rawset(L, -4);
+  } else {
+    lua_remove(L, -2);
+  }
+  lua_getfield(L, -1, "nanoseconds");
+  lua_pushnumber(L, lua_tonumber(L, -1) + nanoseconds);
+  lua_setfield(L, -3, "nanoseconds");
+  lua_getfield(L, -2, "calls");
+  lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+  lua_setfield(L, -4, "calls");
+  lua_pop(L, 2);
+  if (kind) {
+    lua_pushstring(L, kind);
+    lua_setfield(L, -2, "kind");
+  }
+  lua_pop(L, 2);
+}
+
+// drains the ring and returns what was in it:
+// { load, blocks, dropped, kinds = { [kind] = entry }, nodes = { [id] = entry } }
+// where entry is { nanoseconds, calls } and node entries also have the kind.
+// load is the time spent in graphs as a fraction of the audio they rendered
+static int l_read_profile(lua_State *L) {
+  lua_createtable(L, 0, 5);
+  lua_newtable(L);
+  int kinds = lua_gettop(L);
+  lua_newtable(L);
+  int nodes = lua_gettop(L);
+
+  double block_nanoseconds = 0;
+  double block_samples = 0;
+  int blocks = 0;
+  int read = SHARED_LOAD(profile_read);
+  int write = SHARED_LOAD(profile_write);
+  for (; read != write; read = (read + 1) & (PROFILE_RING_SIZE - 1)) {
+    ProfileRecord *record = &profile_ring[read];
+    if (!record->kind) {
+      block_nanoseconds += record->nanoseconds;
+      block_samples += record->sample_count;
+      blocks++;
+      continue;
+    }
+    lua_pushstring(L, record->kind->name);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, kinds);
+    lua_pushvalue(L, kinds);
+    lua_insert(L, -3);
+    add_profile_entry(L, record->nanoseconds, NULL);
+
+    lua_pushinteger(L, record->node_id);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, nodes);
+    lua_pushvalue(L, nodes);
+    lua_insert(L, -3);
+    add_profile_entry(L, record->nanoseconds, record->kind->name);
+  }
+  SHARED_STORE(profile_read, read);
+
+  lua_setfield(L, -3, "nodes");
+  lua_setfield(L, -2, "kinds");
+  lua_pushnumber(L, block_samples > 0 ? block_nanoseconds * 1e-9 / (block_samples / engine_sample_rate) : 0);
+  lua_setfield(L, -2, "load");
+  lua_pushinteger(L, blocks);
+  lua_setfield(L, -2, "blocks");
+  lua_pushinteger(L, SHARED_LOAD(profile_dropped));
+  lua_setfield(L, -2, "dropped");
+  SHARED_STORE(profile_dropped, 0);
+  return 1;
+}
+
+static int l_get_node_id(lua_State *L) {
+  lua_pushinteger(L, check_node(L, 1)->id);
+  return 1;
+}
+
+// graph
+//
+// a graph is a list of nodes in the order they were added. processing a block
+// runs every node without going back through lua. before the first block
+// after nodes are added, the nodes are sorted into levels: a node goes one
+// level after the last earlier node it shares a stream or buffer with where
+// either of them writes, so the nodes in a level are independent and keep the
+// order they were added in where it matters. with workers, levels with more
+// than one node are split between the workers and the calling thread
+//
+// streams that are written before they're read in every block and aren't
+// used outside the graph only need their samples from their first level to
+// their last, so like registers they share slots of one arena with streams
+// whose lifetimes don't overlap. the arena is only as big as the most
+// streams live at once
+
+#define GRAPH_TYPE "dsp_c.graph"
+
+#ifdef DSP_THREADS
+// workers spin this many times waiting for the next level before sleeping,
+// long enough to cover the gap between levels but not between blocks
+#define WORKER_SPIN 4096
+
+static inline void cpu_relax(void) {
+#if defined(DSP_X86)
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ volatile("yield");
+#endif
+}
+
+typedef struct Pool Pool;
+
+// every thread starts on its own share of the level and steals from the
+// others once it runs out, shares are on separate cache lines
+typedef struct {
+  _Alignas(64) atomic_int next;
+  int end;
+  bool hit_limiter;
+  Pool *pool;
+} Share;
+
+struct Pool {
+  int worker_count;
+  // graphs sharing the pool take turns, it stops with the last of them
+  int graph_count;
+  pthread_t *threads;
+  // worker i uses shares[i + 1], the calling thread uses shares[0]
+  Share *shares;
+  Node **nodes;
+  int sample_count;
+  double sample_rate;
+  bool profile;
+  atomic_uint generation;
+  atomic_int running;
+  atomic_int sleepers;
+  atomic_bool quit;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+};
+
+static void run_shares(Pool *pool, int self) {
+  Block block = { NULL, pool->sample_count, false, pool->profile, pool->sample_rate };
+  int share_count = pool->worker_count + 1;
+  for (int k = 0; k < share_count; k++) {
+    Share *share = &pool->shares[(self + k) % share_count];
+    int i;
+    while ((i = atomic_fetch_add_explicit(&share->next, 1, memory_order_relaxed)) < share->end) {
+      run_node(pool->nodes[i], &block);
+    }
+  }
+  pool->shares[self].hit_limiter = block.hit_limiter;
+}
+
+static unsigned wait_for_level(Pool *pool, unsigned seen) {
+  unsigned generation;
+  for (int spin = 0; spin < WORKER_SPIN; spin++) {
+    generation = atomic_load_explicit(&pool->generation, memory_order_acquire);
+    if (generation != seen) {
+      return generation;
+    }
+    cpu_relax();
+  }
+  pthread_mutex_lock(&pool->mutex);
+  atomic_fetch_add(&pool->sleepers, 1);
+  while ((generation = atomic_load(&pool->generation)) == seen) {
+    pthread_cond_wait(&pool->wake, &pool->mutex);
+  }
+  atomic_fetch_sub(&pool->sleepers, 1);
+  pthread_mutex_unlock(&pool->mutex);
+  return generation;
+}
+
+static void *worker_main(void *arg) {
+  Share *share = arg;
+  Pool *pool = share->pool;
+  int self = share - pool->shares;
+  unsigned seen = 0;
+  bool flushing = false;
+  while (true) {
+    seen = wait_for_level(pool, seen);
+    if (atomic_load(&pool->quit)) {
+      return NULL;
+    }
+    if (!flushing && SHARED_LOAD(denormals_flushed)) {
+      flush_denormals_on_this_thread();
+      flushing = true;
+    }
+    run_shares(pool, self);
+    atomic_fetch_sub_explicit(&pool->running, 1, memory_order_release);
+  }
+}
+
+// publishing a new generation wakes the workers, sleeping ones through the
+// condition variable
+static void wake_workers(Pool *pool) {
+  atomic_fetch_add(&pool->generation, 1);
+  if (atomic_load(&pool->sleepers) > 0) {
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+
+static void stop_pool(Pool *pool) {
+  atomic_store(&pool->quit, true);
+  wake_workers(pool);
+  for (int i = 0; i < pool->worker_count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->shares);
+  free(pool->threads);
+  free(pool);
+}
+
+static Pool *start_pool(int worker_count) {
+  Pool *pool = calloc(1, sizeof(Pool));
+  if (!pool) {
+    return NULL;
+  }
+  pool->threads = calloc(worker_count, sizeof(pthread_t));
+  if (posix_memalign((void **) &pool->shares, _Alignof(Share), (worker_count + 1) * sizeof(Share)) != 0) {
+    pool->shares = NULL;
+  }
+  if (!pool->threads || !pool->shares) {
+    free(pool->shares);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+  }
+  memset(pool->shares, 0, (worker_count + 1) * sizeof(Share));
+  pool->graph_count = 1;
+  for (int i = 0; i <= worker_count; i++) {
+    pool->shares[i].pool = pool;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  for (int i = 0; i < worker_count; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker_main, &pool->shares[i + 1]) != 0) {
+      break;
+    }
+    pool->worker_count++;
+  }
+  return pool;
+}
+
+// runs the nodes of one level across the pool, returns once they're all done
+static bool run_level(Pool *pool, Node **nodes, int node_count, Block *block) {
+  int share_count = pool->worker_count + 1;
+  pool->nodes = nodes;
+  pool->sample_count = block->sample_count;
+  pool->sample_rate = block->sample_rate;
+  pool->profile = block->profile;
+  for (int i = 0; i < share_count; i++) {
+    Share *share = &pool->shares[i];
+    atomic_store_explicit(&share->next, node_count * i / share_count, memory_order_relaxed);
+    share->end = node_count * (i + 1) / share_count;
+  }
+  atomic_store_explicit(&pool->running, pool->worker_count, memory_order_relaxed);
+  wake_workers(pool);
+  run_shares(pool, 0);
+  // yields once spinning has gone on for long enough that a worker has
+  // probably been preempted
+  for (int spin = 0; atomic_load_explicit(&pool->running, memory_order_acquire) > 0; spin++) {
+    if (spin < WORKER_SPIN) {
+      cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+  bool hit_limiter = false;
+  for (int i = 0; i < share_count; i++) {
+    hit_limiter |= pool->shares[i].hit_limiter;
+  }
+  return hit_limiter;
+}
+#endif
+
+typedef struct {
+  Node **nodes;
+  int node_count;
+  int node_capacity;
+  // the streams read from outside the graph, only nodes they depend on run.
+  // without outputs every node runs
+  Stream **outputs;
+  int output_count;
+  // nodes sorted by level, level i is order[level_starts[i]] up to
+  // order[level_starts[i + 1]]
+  bool scheduled;
+  Node **order;
+  int *level_starts;
+  int level_count;
+  // the streams moved into the arena, to give back their own buffers
+  Stream **arena_streams;
+  int arena_stream_count;
+  float *arena;
+  int arena_slots;
+#ifdef DSP_THREADS
+  Pool *pool;
+#endif
+} Graph;
+
+// dsp_c.new_graph(worker_count?), without workers every node runs on the
+// calling thread. dsp_c.new_graph(other) shares the workers of other, the two
+// graphs mustn't run at the same time
+static int l_new_graph(lua_State *L) {
+  Graph *other = lua_isuserdata(L, 1) ? luaL_checkudata(L, 1, GRAPH_TYPE) : NULL;
+  int worker_count = other ? 0 : luaL_optinteger(L, 1, 0);
+  luaL_argcheck(L, worker_count >= 0, 1, "worker_count can't be negative");
+  Graph *graph = lua_newuserdata(L, sizeof(Graph));
+  memset(graph, 0, sizeof(Graph));
+  luaL_getmetatable(L, GRAPH_TYPE);
+  lua_setmetatable(L, -2);
+  // the environment keeps the nodes alive
+  lua_newtable(L);
+  lua_setfenv(L, -2);
+#ifdef DSP_THREADS
+  if (other && other->pool) {
+    graph->pool = other->pool;
+    graph->pool->graph_count++;
+  } else if (worker_count > 0) {
+    graph->pool = start_pool(worker_count);
+    if (!graph->pool) {
+      return luaL_error(L, "out of memory");
+    }
+  }
+#endif
+  return 1;
+}
+
+static void release_arena(Graph *graph) {
+  for (int i = 0; i < graph->arena_stream_count; i++) {
+    Stream *stream = graph->arena_streams[i];
+    stream->samples = stream->buffer;
+  }
+  free(graph->arena_streams);
+  aligned_free(graph->arena);
+  graph->arena_streams = NULL;
+  graph->arena_stream_count = 0;
+  graph->arena = NULL;
+  graph->arena_slots = 0;
+}
+
+static int l_graph_gc(lua_State *L) {
+  Graph *graph = luaL_checkudata(L, 1, GRAPH_TYPE);
+  release_arena(graph);
+#ifdef DSP_THREADS
+  if (graph->pool && --graph->pool->graph_count == 0) {
+    stop_pool(graph->pool);
+  }
+  graph->pool = NULL;
+#endif
+  free(graph->nodes);
+  free(graph->outputs);
+  free(graph->order);
+  free(graph->level_starts);
+  graph->nodes = NULL;
+  graph->outputs = NULL;
+  graph->output_count = 0;
+  graph->order = NULL;
+  graph->level_starts = NULL;
+  graph->node_count = 0;
+  graph->level_count = 0;
+  return 0;
+}
+
+// dsp_c.graph_clear(graph) removes every node and output, so the graph can be
+// built again
+static int l_graph_clear(lua_State *L) {
+  Graph *graph = luaL_checkudata(L, 1, GRAPH_TYPE);
+  release_arena(graph);
+  free(graph->outputs);
+  graph->outputs = NULL;
+  graph->output_count = 0;
+  graph->node_count = 0;
+  graph->level_count = 0;
+  graph->scheduled = false;
+  lua_newtable(L);
+  lua_setfenv(L, 1);
+  return 0;
+}
+
+static int l_graph_add(lua_State *L) {
+  Graph *graph = luaL_checkudata(L, 1, GRAPH_TYPE);
+  Node *node = check_node(L, 2);
+
+  if (graph->node_count == graph->node_capacity) {
+    int capacity = maxi(16, graph->node_capacity * 2);
+    Node **nodes = realloc(graph->nodes, capacity * sizeof(Node *));
+    if (!nodes) {
+      return luaL_error(L, "out of memory");
+    }
+    graph->nodes = nodes;
+    graph->node_capacity = capacity;
+  }
+  graph->nodes[graph->node_count++] = node;
+  graph->scheduled = false;
+
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, graph->node_count);
+  lua_pop(L, 1);
+
+  lua_settop(L, 2);
+  return 1;
+}
+
+// dsp_c.graph_set_outputs(graph, outputs) limits the graph to the nodes the
+// outputs depend on, an empty table runs every node again
+static int l_graph_set_outputs(lua_State *L) {
+  Graph *graph = luaL_checkudata(L, 1, GRAPH_TYPE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int count = lua_objlen(L, 2);
+  Stream **outputs = malloc((count + 1) * sizeof(Stream *));
+  if (!outputs) {
+    return luaL_error(L, "out of memory");
+  }
+  for (int i = 1; i <= count; i++) {
+    lua_rawgeti(L, 2, i);
+    outputs[i - 1] = lua_touserdata(L, -1);
+    bool is_stream = outputs[i - 1] && lua_getmetatable(L, -1);
+    if (is_stream) {
+      luaL_getmetatable(L, STREAM_TYPE);
+      is_stream = lua_rawequal(L, -1, -2);
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+    if (!is_stream) {
+      free(outputs);
+      return luaL_argerror(L, 2, "expected a table of streams");
+    }
+  }
+  free(graph->outputs);
+  graph->outputs = outputs;
+  graph->output_count = count;
+  graph->scheduled = false;
+
+  // the environment keeps the outputs alive
+  lua_getfenv(L, 1);
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "outputs");
+  lua_pop(L, 1);
+  return 0;
+}
+
+static bool nodes_conflict(const Node *a, const Node *b) {
+  for (int i = 0; i < a->access_count; i++) {
+    for (int j = 0; j < b->access_count; j++) {
+      if (a->accesses[i].resource == b->accesses[j].resource && (a->accesses[i].write || b->accesses[j].write)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static bool is_mix(const Node *node) {
+  return node->process == add_process || node->process == multiply_process;
+}
+
+typedef struct {
+  Stream *stream;
+  int access_count;
+  int first_level;
+  int last_level;
+  bool read_first;
+} Lifetime;
+
+// records the node's accesses at level, mixes fused into the node are run
+// at the same level
+static void add_lifetimes(Node *node, int level, Lifetime *lifetimes, int *lifetime_count) {
+  for (int a = 0; a < node->access_count; a++) {
+    Access *access = &node->accesses[a];
+    if (!access->stream) {
+      continue;
+    }
+    Stream *stream = (Stream *) access->resource;
+    if (stream->schedule_index < 0) {
+      stream->schedule_index = *lifetime_count;
+      lifetimes[(*lifetime_count)++] = (Lifetime) { stream, 0, level, level, false };
+    }
+    Lifetime *lifetime = &lifetimes[stream->schedule_index];
+    lifetime->access_count++;
+    lifetime->last_level = level;
+    // nodes at the first level only read what earlier blocks left behind
+    if (!access->write && level == lifetime->first_level) {
+      lifetime->read_first = true;
+    }
+  }
+  if (is_mix(node)) {
+    MixNode *mix = (MixNode *) node;
+    for (int i = 0; i < mix->input_count && mix->producer_count > 0; i++) {
+      if (mix->producers[i]) {
+        add_lifetimes(&mix->producers[i]->node, level, lifetimes, lifetime_count);
+      }
+    }
+  }
+}
+
+static void allocate_arena(lua_State *L, Graph *graph) {
+  release_arena(graph);
+
+  int access_count = 0;
+  int slot_limit = 0;
+  for (int i = 0; i < graph->node_count; i++) {
+    Node *node = graph->nodes[i];
+    access_count += node->access_count;
+    for (int a = 0; a < node->access_count; a++) {
+      if (node->accesses[a].stream) {
+        slot_limit += ((Stream *) node->accesses[a].resource)->channel_count;
+      }
+    }
+  }
+  Lifetime *lifetimes = malloc((access_count + 1) * sizeof(Lifetime));
+  int *slot_ends = malloc((slot_limit + 1) * sizeof(int));
+  Stream **arena_streams = malloc((access_count + 1) * sizeof(Stream *));
+  if (!lifetimes || !slot_ends || !arena_streams) {
+    free(lifetimes);
+    free(slot_ends);
+    free(arena_streams);
+    luaL_error(L, "out of memory");
+  }
+
+  // lifetimes come out sorted by first level
+  int lifetime_count = 0;
+  for (int l = 0; l < graph->level_count; l++) {
+    for (int i = graph->level_starts[l]; i < graph->level_starts[l + 1]; i++) {
+      add_lifetimes(graph->order[i], l, lifetimes, &lifetime_count);
+    }
+  }
+
+  // greedy interval colouring, a slot is free once its last stream's last
+  // level is done. the slot is kept in schedule_index until the arena exists.
+  // every channel takes a slot, and a stream's slots are next to each other
+  int slot_count = 0;
+  int arena_stream_count = 0;
+  for (int i = 0; i < lifetime_count; i++) {
+    Lifetime *lifetime = &lifetimes[i];
+    Stream *stream = lifetime->stream;
+    stream->schedule_index = -1;
+    if (!stream->buffer || stream->pinned || lifetime->read_first || lifetime->access_count != stream->access_count) {
+      continue;
+    }
+    int channel_count = stream->channel_count;
+    int slot = 0;
+    for (int free_count = 0; free_count < channel_count; slot++) {
+      bool free = slot >= slot_count || slot_ends[slot] < lifetime->first_level;
+      free_count = free ? free_count + 1 : 0;
+    }
+    slot -= channel_count;
+    slot_count = maxi(slot_count, slot + channel_count);
+    for (int c = 0; c < channel_count; c++) {
+      slot_ends[slot + c] = lifetime->last_level;
+    }
+    stream->schedule_index = slot;
+    arena_streams[arena_stream_count++] = stream;
+  }
+
+  float *arena = slot_count > 0 ? aligned_malloc(slot_count * engine_block_size * sizeof(float)) : NULL;
+  for (int i = 0; i < arena_stream_count; i++) {
+    Stream *stream = arena_streams[i];
+    if (arena) {
+      stream->samples = arena + stream->schedule_index * engine_block_size;
+    }
+    stream->schedule_index = -1;
+  }
+  if (slot_count > 0 && !arena) {
+    free(lifetimes);
+    free(slot_ends);
+    free(arena_streams);
+    luaL_error(L, "out of memory");
+  }
+  if (arena) {
+    kernels.fill(arena, 0, slot_count * engine_block_size);
+  }
+
+  free(lifetimes);
+  free(slot_ends);
+  graph->arena_streams = arena_streams;
+  graph->arena_stream_count = arena_stream_count;
+  graph->arena = arena;
+  graph->arena_slots = slot_count;
+}
+
+// finds the node in the graph that reads stream, if it's the only one
+static int single_reader(Graph *graph, const Stream *stream) {
+  int reader = -1;
+  for (int i = 0; i < graph->node_count; i++) {
+    Node *node = graph->nodes[i];
+    for (int a = 0; a < node->access_count; a++) {
+      if (node->accesses[a].resource == stream && !node->accesses[a].write) {
+        if (reader >= 0) {
+          return -1;
+        }
+        reader = i;
+      }
+    }
+  }
+  return reader;
+}
+
+// whether every write to resource in the graph happens before level, so it
+// stays put until the end of the block
+static bool written_before(Graph *graph, const int *levels, const void *resource, int level) {
+  for (int i = 0; i < graph->node_count; i++) {
+    Node *node = graph->nodes[i];
+    for (int a = 0; a < node->access_count; a++) {
+      if (node->accesses[a].resource == resource && node->accesses[a].write && levels[i] >= level) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// function nodes run lua that can change any stream without declaring it,
+// so one from the producer's level up to the consumer's could change the
+// producer's inputs before the consumer reads them
+static bool function_between(Graph *graph, const int *levels, int first_level, int last_level) {
+  for (int i = 0; i < graph->node_count; i++) {
+    if (graph->nodes[i]->process == function_process && levels[i] >= first_level && levels[i] < last_level) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// fuses mono mixes into the mix that's the only reader of their output. the
+// producer's inputs must not change after it would have run, since the
+// consumer reads them later
+static void fuse_mixes(Graph *graph, const int *levels) {
+  for (int i = 0; i < graph->node_count; i++) {
+    if (is_mix(graph->nodes[i])) {
+      MixNode *mix = (MixNode *) graph->nodes[i];
+      mix->fused = false;
+      mix->producer_count = 0;
+      memset(mix->producers, 0, mix->input_count * sizeof(MixNode *));
+    }
+  }
+  for (int i = 0; i < graph->node_count; i++) {
+    if (!is_mix(graph->nodes[i])) {
+      continue;
+    }
+    MixNode *producer = (MixNode *) graph->nodes[i];
+    Stream *stream = producer->output;
+    // the producer's write and the consumer's read are the only uses
+    if (stream->channel_count != 1 || stream->pinned || stream->access_count != 2) {
+      continue;
+    }
+    int reader = single_reader(graph, stream);
+    if (reader < 0 || !is_mix(graph->nodes[reader]) || ((MixNode *) graph->nodes[reader])->output->channel_count != 1) {
+      continue;
+    }
+    bool inputs_stay = !function_between(graph, levels, levels[i], levels[reader]);
+    for (int j = 0; j < producer->input_count && inputs_stay; j++) {
+      inputs_stay = written_before(graph, levels, producer->inputs[j], levels[i]);
+    }
+    if (!inputs_stay) {
+      continue;
+    }
+    MixNode *consumer = (MixNode *) graph->nodes[reader];
+    for (int j = 0; j < consumer->input_count; j++) {
+      if (consumer->inputs[j] == stream) {
+        consumer->producers[j] = producer;
+        consumer->producer_count++;
+      }
+    }
+    producer->fused = true;
+  }
+}
+
+static bool is_fused(const Node *node) {
+  return is_mix(node) && ((const MixNode *) node)->fused;
+}
+
+static bool contains_resource(const void **resources, int count, const void *resource) {
+  for (int i = 0; i < count; i++) {
+    if (resources[i] == resource) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// walks back from the outputs, a node is live when it writes something a live
+// node reads. function nodes call back into lua so they're always live, but
+// subgraphs are traced through their outputs like any other node. delays can
+// feed back into themselves, so this repeats until nothing changes
+static void mark_live(Graph *graph, bool *live, const void **resources) {
+  if (graph->output_count == 0) {
+    memset(live, true, graph->node_count * sizeof(bool));
+    return;
+  }
+  memset(live, false, graph->node_count * sizeof(bool));
+  int resource_count = 0;
+  for (int i = 0; i < graph->output_count; i++) {
+    resources[resource_count++] = graph->outputs[i];
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = graph->node_count - 1; i >= 0; i--) {
+      Node *node = graph->nodes[i];
+      bool needed = node->process == function_process;
+      for (int a = 0; a < node->access_count && !needed && !live[i]; a++) {
+        needed = node->accesses[a].write && contains_resource(resources, resource_count, node->accesses[a].resource);
+      }
+      if (live[i] || !needed) {
+        continue;
+      }
+      live[i] = true;
+      changed = true;
+      for (int a = 0; a < node->access_count; a++) {
+        if (!node->accesses[a].write) {
+          resources[resource_count++] = node->accesses[a].resource;
+        }
+      }
+    }
+  }
+}
+
+static void schedule_graph(lua_State *L, Graph *graph) {
+  int node_count = graph->node_count;
+  int access_count = graph->output_count;
+  for (int i = 0; i < node_count; i++) {
+    access_count += graph->nodes[i]->access_count;
+  }
+  int *levels = malloc((node_count + 1) * sizeof(int));
+  Node **order = malloc((node_count + 1) * sizeof(Node *));
+  int *level_starts = malloc((node_count + 2) * sizeof(int));
+  bool *live = malloc((node_count + 1) * sizeof(bool));
+  const void **resources = malloc((access_count + 1) * sizeof(void *));
+  if (!levels || !order || !level_starts || !live || !resources) {
+    free(levels);
+    free(order);
+    free(level_starts);
+    free(live);
+    free(resources);
+    luaL_error(L, "out of memory");
+  }
+
+  mark_live(graph, live, resources);
+  free(resources);
+
+  // barriers go after everything before them, and everything after them
+  // goes after the barrier. nodes that aren't live don't take part
+  int level_count = 0;
+  int first_level = 0;
+  for (int i = 0; i < node_count; i++) {
+    Node *node = graph->nodes[i];
+    int level = first_level;
+    if (!live[i]) {
+      levels[i] = -1;
+      continue;
+    }
+    if (node->kind->barrier) {
+      level = level_count;
+      first_level = level + 1;
+    } else {
+      for (int j = 0; j < i; j++) {
+        if (levels[j] >= level && nodes_conflict(graph->nodes[j], node)) {
+          level = levels[j] + 1;
+        }
+      }
+    }
+    levels[i] = level;
+    level_count = maxi(level_count, level + 1);
+  }
+
+  fuse_mixes(graph, levels);
+
+  // counting sort keeps the order within each level, fused nodes are left
+  // out since the nodes they're fused into run them
+  memset(level_starts, 0, (level_count + 1) * sizeof(int));
+  for (int i = 0; i < node_count; i++) {
+    live[i] = live[i] && !is_fused(graph->nodes[i]);
+    if (live[i]) {
+      level_starts[levels[i] + 1]++;
+    }
+  }
+  for (int l = 0; l < level_count; l++) {
+    level_starts[l + 1] += level_starts[l];
+  }
+  for (int i = 0; i < node_count; i++) {
+    if (live[i]) {
+      order[level_starts[levels[i]]++] = graph->nodes[i];
+    }
+  }
+  for (int l = level_count; l > 0; l--) {
+    level_starts[l] = level_starts[l - 1];
+  }
+  level_starts[0] = 0;
+
+  free(levels);
+  free(live);
+  free(graph->order);
+  free(graph->level_starts);
+  graph->order = order;
+  graph->level_starts = level_starts;
+  graph->level_count = level_count;
+  allocate_arena(L, graph);
+  graph->scheduled = true;
+}
+
+// dsp_c.graph_schedule(graph) schedules the graph ahead of its first block,
+// otherwise graph_process does it when the graph has changed
+static int l_graph_schedule(lua_State *L) {
+  Graph *graph = luaL_checkudata(L, 1, GRAPH_TYPE);
+  if (!graph->scheduled) {
+    schedule_graph(L, graph);
+  }
+  return 0;
+}
+
+static void run_graph(Graph *graph, Block *block) {
+  if (!graph->scheduled) {
+    schedule_graph(block->L, graph);
+  }
+  for (int l = 0; l < graph->level_count; l++) {
+    Node **nodes = graph->order + graph->level_starts[l];
+    int node_count = graph->level_starts[l + 1] - graph->level_starts[l];
+#ifdef DSP_THREADS
+    if (graph->pool && node_count > 1) {
+      block->hit_limiter |= run_level(graph->pool, nodes, node_count, block);
+      continue;
+    }
+#endif
+    for (int i = 0; i < node_count; i++) {
+      run_node(nodes[i], block);
+    }
+  }
+}
+
+// runs a graph at the top level, where blocks are profiled as a whole
+static void process_graph(Graph *graph, Block *block) {
+  block->profile = SHARED_LOAD(profile_enabled);
+  uint64_t start = block->profile ? get_nanoseconds() : 0;
+  run_graph(graph, block);
+  if (block->profile) {
+    push_profile(graph->order, graph->level_starts[graph->level_count], get_nanoseconds() - start, block->sample_count);
+  }
+}
+
+// returns whether any limiter in the graph was hit during the block
+static int l_graph_process(lua_State *L) {
+  Graph *graph = luaL_checkudata(L, 1, GRAPH_TYPE);
+  Block block = { L, check_sample_count(L, 2), .sample_rate = engine_sample_rate };
+  process_graph(graph, &block);
+  lua_pushboolean(L, block.hit_limiter);
+  return 1;
+}
+
+// subgraphs
+//
+// a subgraph node runs a graph at factor times the rate of the graph it's in,
+// or at 1 / factor of it, e.g. to oversample saturation or to run slow
+// modulation cheaply. inputs are resampled into inner_inputs before the
+// graph runs and inner_outputs are resampled back into outputs after. the
+// inner streams are mono and belong to the subgraph, not to any graph
+//
+// the resamplers are polyphase windowed sinc filters, with RESAMPLER_TAPS
+// taps per phase. upsampling only evaluates the taps that line up with real
+// inputs, downsampling only evaluates the outputs it keeps. decimated
+// outputs come back factor samples late, since each slow sample is only
+// known once all factor fast ones are in
+
+#define RESAMPLER_TAPS 8
+#define MAX_RESAMPLE_FACTOR 8
+#define RESAMPLER_LENGTH (RESAMPLER_TAPS * MAX_RESAMPLE_FACTOR)
+
+typedef struct {
+  // the last inputs oldest first from history[position], written twice so
+  // the window never wraps
+  float history[2 * RESAMPLER_LENGTH];
+  int position;
+  // inputs since the last decimated output
+  int phase;
+  // upsampled samples left over for the next block
+  float pending[MAX_RESAMPLE_FACTOR];
+  int pending_count;
+} Resampler;
+
+typedef struct {
+  Node node;
+  Graph *graph;
+  bool oversample;
+  int factor;
+  int input_count;
+  int output_count;
+  Stream **inputs;
+  Stream **inner_inputs;
+  Stream **inner_outputs;
+  Stream **outputs;
+  // inputs first, then outputs
+  Resampler *resamplers;
+  // the lowpass at the fast rate, symmetric so it's the same either way round
+  float taps[RESAMPLER_LENGTH];
+  // phase p of the upsampler, oldest input first and scaled by factor
+  float phase_taps[MAX_RESAMPLE_FACTOR][RESAMPLER_TAPS];
+  max_align_t data[];
+} SubgraphNode;
+
+static void init_resampler_taps(SubgraphNode *subgraph) {
+  int factor = subgraph->factor;
+  int length = RESAMPLER_TAPS * factor;
+  // a little under the slow rate's nyquist
+  double cutoff = 0.45 / factor;
+  double center = (length - 1) / 2.0;
+  double sum = 0;
+  for (int j = 0; j < length; j++) {
+    double t = j - center;
+    double sinc = t == 0 ? 2 * cutoff : sin(2 * PI * cutoff * t) / (PI * t);
+    double window = 0.42 - 0.5 * cos(2 * PI * (j + 0.5) / length) + 0.08 * cos(4 * PI * (j + 0.5) / length);
+    subgraph->taps[j] = sinc * window;
+    sum += subgraph->taps[j];
+  }
+  for (int j = 0; j < length; j++) {
+    subgraph->taps[j] /= sum;
+  }
+  for (int p = 0; p < factor; p++) {
+    for (int m = 0; m < RESAMPLER_TAPS; m++) {
+      subgraph->phase_taps[p][m] = factor * subgraph->taps[p + (RESAMPLER_TAPS - 1 - m) * factor];
+    }
+  }
+}
+
+static const float *resampler_push(Resampler *resampler, float x, int length) {
+  resampler->history[resampler->position] = x;
+  resampler->history[resampler->position + length] = x;
+  resampler->position = resampler->position + 1 == length ? 0 : resampler->position + 1;
+  return resampler->history + resampler->position;
+}
+
+// writes factor samples to output for every input
+static void upsample(const SubgraphNode *subgraph, Resampler *resampler, const float *input, int sample_count, float *output) {
+  int factor = subgraph->factor;
+  for (int i = 0; i < sample_count; i++) {
+    const float *window = resampler_push(resampler, input[i], RESAMPLER_TAPS);
+    for (int p = 0; p < factor; p++) {
+      float sum = 0;
+      for (int m = 0; m < RESAMPLER_TAPS; m++) {
+        sum += subgraph->phase_taps[p][m] * window[m];
+      }
+      output[i * factor + p] = sum;
+    }
+  }
+}
+
+// writes an output for every factor inputs, returns how many it wrote
+static int downsample(const SubgraphNode *subgraph, Resampler *resampler, const float *input, int sample_count, float *output) {
+  int factor = subgraph->factor;
+  int length = RESAMPLER_TAPS * factor;
+  int count = 0;
+  for (int i = 0; i < sample_count; i++) {
+    const float *window = resampler_push(resampler, input[i], length);
+    if (++resampler->phase < factor) {
+      continue;
+    }
+    resampler->phase = 0;
+    float sum = 0;
+    for (int j = 0; j < length; j++) {
+      sum += subgraph->taps[j] * window[j];
+    }
+    output[count++] = sum;
+  }
+  return count;
+}
+
+static void subgraph_run(SubgraphNode *subgraph, const Block *block, int sample_count) {
+  Block inner = { block->L, sample_count, false, false, block->sample_rate };
+  inner.sample_rate = subgraph->oversample ? block->sample_rate * subgraph->factor : block->sample_rate / subgraph->factor;
+  run_graph(subgraph->graph, &inner);
+}
+
+static void subgraph_process(Node *node, Block *block) {
+  SubgraphNode *subgraph = (SubgraphNode *) node;
+  int factor = subgraph->factor;
+  int sample_count = block->sample_count;
+  float scratch[MAX_BLOCK_SIZE];
+  Resampler *output_resamplers = subgraph->resamplers + subgraph->input_count;
+  for (int o = 0; o < subgraph->output_count; o++) {
+    write_stream(subgraph->outputs[o]);
+  }
+
+  if (subgraph->oversample) {
+    // the inner graph runs several times when the fast block wouldn't fit
+    int chunk = engine_block_size / factor;
+    for (int offset = 0; offset < sample_count; offset += chunk) {
+      int count = mini(chunk, sample_count - offset);
+      for (int i = 0; i < subgraph->input_count; i++) {
+        const float *input = read_stream(subgraph->inputs[i], scratch, sample_count);
+        upsample(subgraph, &subgraph->resamplers[i], input + offset, count, write_stream(subgraph->inner_inputs[i]));
+      }
+      subgraph_run(subgraph, block, count * factor);
+      for (int o = 0; o < subgraph->output_count; o++) {
+        const float *inner = read_stream(subgraph->inner_outputs[o], scratch, count * factor);
+        downsample(subgraph, &output_resamplers[o], inner, count * factor, subgraph->outputs[o]->samples + offset);
+      }
+    }
+    return;
+  }
+
+  int inner_count = 0;
+  for (int i = 0; i < subgraph->input_count; i++) {
+    Resampler *resampler = &subgraph->resamplers[i];
+    const float *input = read_stream(subgraph->inputs[i], scratch, sample_count);
+    // every input resampler has seen the same samples, so they agree
+    inner_count = downsample(subgraph, resampler, input, sample_count, write_stream(subgraph->inner_inputs[i]));
+  }
+  if (subgraph->input_count == 0) {
+    // without inputs the phase is kept in the first output's resampler
+    Resampler *resampler = &output_resamplers[0];
+    inner_count = (resampler->phase + sample_count) / factor;
+    resampler->phase = (resampler->phase + sample_count) % factor;
+  }
+  if (inner_count > 0) {
+    subgraph_run(subgraph, block, inner_count);
+  }
+  for (int o = 0; o < subgraph->output_count; o++) {
+    Resampler *resampler = &output_resamplers[o];
+    float upsampled[MAX_BLOCK_SIZE + 2 * MAX_RESAMPLE_FACTOR];
+    memcpy(upsampled, resampler->pending, resampler->pending_count * sizeof(float));
+    int available = resampler->pending_count + inner_count * factor;
+    if (inner_count > 0) {
+      const float *inner = read_stream(subgraph->inner_outputs[o], scratch, inner_count);
+      upsample(subgraph, resampler, inner, inner_count, upsampled + resampler->pending_count);
+    }
+    memcpy(subgraph->outputs[o]->samples, upsampled, sample_count * sizeof(float));
+    resampler->pending_count = available - sample_count;
+    memcpy(resampler->pending, upsampled + sample_count, resampler->pending_count * sizeof(float));
+  }
+}
+
+// the inner streams are read and written by the subgraph outside of the
+// inner graph, so they're pinned to keep them out of its arena
+static void check_inner_streams(lua_State *L, int n, const char *name, Stream **streams, int count) {
+  lua_getfield(L, n, name);
+  luaL_checktype(L, -1, LUA_TTABLE);
+  if ((int) lua_objlen(L, -1) != count) {
+    luaL_error(L, "%s needs %d streams", name, count);
+  }
+  for (int i = 0; i < count; i++) {
+    lua_rawgeti(L, -1, i + 1);
+    streams[i] = luaL_checkudata(L, -1, STREAM_TYPE);
+    lua_pop(L, 1);
+    if (!streams[i]->buffer || streams[i]->channel_count != 1) {
+      luaL_error(L, "%s must be mono streams with buffers", name);
+    }
+    streams[i]->pinned = true;
+  }
+  lua_pop(L, 1);
+}
+
+static int field_length(lua_State *L, int n, const char *name) {
+  lua_getfield(L, n, name);
+  int length = lua_istable(L, -1) ? (int) lua_objlen(L, -1) : 0;
+  lua_pop(L, 1);
+  return length;
+}
+
+static Node *subgraph_create(lua_State *L, int n) {
+  int input_count = field_length(L, n, "inputs");
+  int output_count = field_length(L, n, "outputs");
+  size_t size = sizeof(SubgraphNode) + (input_count + output_count) * (sizeof(Resampler) + 2 * sizeof(Stream *));
+  SubgraphNode *subgraph = new_node(L, size, subgraph_process);
+  subgraph->graph = check_udata_field(L, n, "graph", GRAPH_TYPE);
+  subgraph->factor = check_integer_field(L, n, "factor");
+  subgraph->oversample = opt_bool_field(L, n, "oversample", false);
+  luaL_argcheck(L, subgraph->factor >= 1 && subgraph->factor <= MAX_RESAMPLE_FACTOR, n, "factor must be between 1 and 8");
+  luaL_argcheck(L, subgraph->factor <= engine_block_size, n, "factor can't be more than the max block size");
+  luaL_argcheck(L, input_count + output_count > 0, n, "a subgraph needs inputs or outputs");
+  subgraph->input_count = input_count;
+  subgraph->output_count = output_count;
+  subgraph->resamplers = (Resampler *) subgraph->data;
+  subgraph->inputs = (Stream **) (subgraph->resamplers + input_count + output_count);
+  subgraph->inner_inputs = subgraph->inputs + input_count;
+  subgraph->outputs = subgraph->inner_inputs + input_count;
+  subgraph->inner_outputs = subgraph->outputs + output_count;
+  memset(subgraph->resamplers, 0, (input_count + output_count) * sizeof(Resampler));
+  // decimated outputs start factor samples late
+  for (int o = 0; o < output_count && !subgraph->oversample; o++) {
+    subgraph->resamplers[input_count + o].pending_count = subgraph->factor;
+  }
+  init_resampler_taps(subgraph);
+
+  if (input_count > 0) {
+    check_stream_array_field(L, n, "inputs", subgraph->inputs, input_count, false, &subgraph->node);
+  }
+  if (output_count > 0) {
+    check_stream_array_field(L, n, "outputs", subgraph->outputs, output_count, true, &subgraph->node);
+  }
+  check_inner_streams(L, n, "inner_inputs", subgraph->inner_inputs, input_count);
+  check_inner_streams(L, n, "inner_outputs", subgraph->inner_outputs, output_count);
+  return &subgraph->node;
+}
+
+static int l_get_core_count(lua_State *L) {
+#ifdef DSP_THREADS
+  lua_pushinteger(L, maxi(1, sysconf(_SC_NPROCESSORS_ONLN)));
+#else
+  lua_pushinteger(L, 1);
+#endif
+  return 1;
+}
+
+// wakeup
+//
+// the audio thread blocks in dsp_c.wait(seconds) until the output is due to
+// have room for another block, instead of polling. any thread can end the
+// wait early with dsp_c.wake(), a wake that comes before the wait isn't lost.
+// the state is global so it's shared by every lua state that loads dsp_c
+
+#ifdef _WIN32
+static SRWLOCK wake_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE wake_condition = CONDITION_VARIABLE_INIT;
+#else
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_condition;
+static pthread_once_t wake_once = PTHREAD_ONCE_INIT;
+
+// waits are measured on the monotonic clock so changing the time of day
+// doesn't stretch them, macos has no monotonic condition variables but can
+// wait for a relative time instead
+static void init_wake_condition(void) {
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+#ifndef __APPLE__
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+#endif
+  pthread_cond_init(&wake_condition, &attributes);
+  pthread_condattr_destroy(&attributes);
+}
+#endif
+
+static bool wake_pending = false;
+
+// returns whether the wait was ended by dsp_c.wake rather than timing out
+static int l_wait(lua_State *L) {
+  double seconds = luaL_checknumber(L, 1);
+  bool woken;
+#ifdef _WIN32
+  DWORD milliseconds = seconds > 0 ? (DWORD) ceil(seconds * 1000) : 0;
+  AcquireSRWLockExclusive(&wake_lock);
+  if (!wake_pending) {
+    SleepConditionVariableSRW(&wake_condition, &wake_lock, milliseconds, 0);
+  }
+  woken = wake_pending;
+  wake_pending = false;
+  ReleaseSRWLockExclusive(&wake_lock);
+#else
+  pthread_once(&wake_once, init_wake_condition);
+  long long nanoseconds = seconds > 0 ? (long long) (seconds * 1e9) : 0;
+#ifdef __APPLE__
+  uint64_t deadline = get_nanoseconds() + nanoseconds;
+#else
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  nanoseconds += deadline.tv_nsec;
+  deadline.tv_sec += nanoseconds / 1000000000;
+  deadline.tv_nsec = nanoseconds % 1000000000;
+#endif
+  pthread_mutex_lock(&wake_mutex);
+  while (!wake_pending) {
+#ifdef __APPLE__
+    // the wait is relative, so after a spurious wakeup only what's left of
+    // it is waited again
+    uint64_t now = get_nanoseconds();
+    if (now >= deadline) {
+      break;
+    }
+    uint64_t remaining = deadline - now;
+    struct timespec timeout = { remaining / 1000000000, remaining % 1000000000 };
+    int result = pthread_cond_timedwait_relative_np(&wake_condition, &wake_mutex, &timeout);
+#else
+    int result = pthread_cond_timedwait(&wake_condition, &wake_mutex, &deadline);
+#endif
+    if (result != 0) {
+      break;
+    }
+  }
+  woken = wake_pending;
+  wake_pending = false;
+  pthread_mutex_unlock(&wake_mutex);
+#endif
+  lua_pushboolean(L, woken);
+  return 1;
+}
+
+static int l_wake(lua_State *L) {
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&wake_lock);
+  wake_pending = true;
+  ReleaseSRWLockExclusive(&wake_lock);
+  WakeAllConditionVariable(&wake_condition);
+#else
+  pthread_once(&wake_once, init_wake_condition);
+  pthread_mutex_lock(&wake_mutex);
+  wake_pending = true;
+  pthread_cond_broadcast(&wake_condition);
+  pthread_mutex_unlock(&wake_mutex);
+#endif
+  return 0;
+}
+
+// telemetry
+//
+// the audio thread records how the output is doing and any thread can read
+// it back, to find the smallest output buffer that never underruns
+//
+// the audio thread never waits on a reader: it's the only one writing, and
+// after each record it publishes a copy under a sequence count that's odd
+// while the copy is being written. readers retry until the count is the same
+// even number on both sides of their read. resets are only requested, the
+// audio thread applies them at its next record
+
+typedef struct {
+  int underruns;
+  int overruns;
+  int fill_frames;
+  int min_fill_frames;
+  int output_frames;
+  int blocks;
+  // blocks in which a limiter brought the gain down
+  int limiter_hits;
+  double worst_render_seconds;
+  // worst render time as a fraction of the time the block lasts
+  double worst_render_load;
+} Telemetry;
+
+// only the audio thread touches telemetry and telemetry_resets_applied
+static Telemetry telemetry = { .min_fill_frames = -1 };
+static int telemetry_resets_applied;
+static Telemetry published_telemetry = { .min_fill_frames = -1 };
+static shared_int telemetry_sequence;
+static shared_int telemetry_resets;
+
+// keeps the current fill level and output size
+static void begin_record(void) {
+  int resets = SHARED_LOAD(telemetry_resets);
+  if (resets != telemetry_resets_applied) {
+    telemetry = (Telemetry) {
+      .fill_frames = telemetry.fill_frames,
+      .min_fill_frames = -1,
+      .output_frames = telemetry.output_frames,
+    };
+    telemetry_resets_applied = resets;
+  }
+}
+
+static void publish_telemetry(void) {
+  (void) SHARED_INCREMENT(telemetry_sequence);
+  SHARED_FENCE();
+  published_telemetry = telemetry;
+  (void) SHARED_INCREMENT(telemetry_sequence);
+}
+
+static Telemetry read_telemetry(void) {
+  Telemetry copy;
+  int sequence;
+  do {
+    while ((sequence = SHARED_LOAD(telemetry_sequence)) & 1) {
+    }
+    copy = published_telemetry;
+    SHARED_FENCE();
+  } while (SHARED_LOAD(telemetry_sequence) != sequence);
+  return copy;
+}
+
+static int l_get_time(lua_State *L) {
+  lua_pushnumber(L, get_nanoseconds() * 1e-9);
+  return 1;
+}
+
+// dsp_c.record_fill(fill_frames, output_frames, underrun) before rendering
+static int l_record_fill(lua_State *L) {
+  int fill_frames = luaL_checkinteger(L, 1);
+  int output_frames = luaL_checkinteger(L, 2);
+  bool underrun = lua_toboolean(L, 3);
+  begin_record();
+  telemetry.fill_frames = fill_frames;
+  telemetry.output_frames = output_frames;
+  if (telemetry.min_fill_frames < 0 || fill_frames < telemetry.min_fill_frames) {
+    telemetry.min_fill_frames = fill_frames;
+  }
+  telemetry.underruns += underrun;
+  publish_telemetry();
+  return 0;
+}
+
+// dsp_c.record_render(render_seconds, block_seconds, overrun, hit_limiter)
+// after each block
+static int l_record_render(lua_State *L) {
+  double render_seconds = luaL_checknumber(L, 1);
+  double block_seconds = luaL_checknumber(L, 2);
+  bool overrun = lua_toboolean(L, 3);
+  bool hit_limiter = lua_toboolean(L, 4);
+  begin_record();
+  telemetry.blocks++;
+  telemetry.overruns += overrun;
+  telemetry.limiter_hits += hit_limiter;
+  if (render_seconds > telemetry.worst_render_seconds) {
+    telemetry.worst_render_seconds = render_seconds;
+  }
+  if (block_seconds > 0 && render_seconds / block_seconds > telemetry.worst_render_load) {
+    telemetry.worst_render_load = render_seconds / block_seconds;
+  }
+  publish_telemetry();
+  return 0;
+}
+
+static int l_get_telemetry(lua_State *L) {
+  Telemetry copy = read_telemetry();
+  lua_createtable(L, 0, 9);
+  lua_pushinteger(L, copy.underruns);
+  lua_setfield(L, -2, "underruns");
+  lua_pushinteger(L, copy.overruns);
+  lua_setfield(L, -2, "overruns");
+  lua_pushinteger(L, copy.fill_frames);
+  lua_setfield(L, -2, "fill_frames");
+  lua_pushinteger(L, maxi(0, copy.min_fill_frames));
+  lua_setfield(L, -2, "min_fill_frames");
+  lua_pushinteger(L, copy.output_frames);
+  lua_setfield(L, -2, "output_frames");
+  lua_pushinteger(L, copy.blocks);
+  lua_setfield(L, -2, "blocks");
+  lua_pushinteger(L, copy.limiter_hits);
+  lua_setfield(L, -2, "limiter_hits");
+  lua_pushnumber(L, copy.worst_render_seconds);
+  lua_setfield(L, -2, "worst_render_seconds");
+  lua_pushnumber(L, copy.worst_render_load);
+  lua_setfield(L, -2, "worst_render_load");
+  return 1;
+}
+
+static int l_reset_telemetry(lua_State *L) {
+  (void) SHARED_INCREMENT(telemetry_resets);
+  return 0;
+}
+
+// commands
+//
+// the main thread sends commands to the audio thread through a single
+// producer single consumer ring, so neither side ever waits on the other.
+// every thread loads dsp_c into its own lua state, so the ring is global.
+// the audio thread applies set_value commands to the values it bound to ids,
+// and hands every other command back to lua between blocks
+
+#define COMMAND_QUEUE_SIZE 1024
+// positions run over twice the size so a full ring isn't mistaken for an
+// empty one
+#define COMMAND_POSITION_MASK (2 * COMMAND_QUEUE_SIZE - 1)
+#define MAX_BOUND_VALUES 1024
+
+enum {
+  COMMAND_SET_VALUE,
+  COMMAND_CONNECT,
+  COMMAND_DISCONNECT,
+  COMMAND_SWAP_GRAPH,
+};
+
+static const char *const command_names[] = { "set_value", "connect", "disconnect", "swap_graph", NULL };
+
+typedef struct {
+  int type;
+  int target;
+  double value;
+} Command;
+
+static Command command_queue[COMMAND_QUEUE_SIZE];
+// only the main thread stores the head and only the audio thread the tail
+static shared_int command_head;
+static shared_int command_tail;
+
+// only touched by the audio thread
+static Value *bound_values[MAX_BOUND_VALUES];
+
+static int check_command_target(lua_State *L, int n) {
+  int target = luaL_checkinteger(L, n);
+  luaL_argcheck(L, target >= 0 && target < MAX_BOUND_VALUES, n, "target out of range");
+  return target;
+}
+
+// returns false when the ring is full
+static bool queue_command(int type, int target, double value) {
+  int head = SHARED_LOAD(command_head);
+  int tail = SHARED_LOAD(command_tail);
+  if (((head - tail) & COMMAND_POSITION_MASK) == COMMAND_QUEUE_SIZE) {
+    return false;
+  }
+  command_queue[head % COMMAND_QUEUE_SIZE] = (Command) { type, target, value };
+  SHARED_STORE(command_head, (head + 1) & COMMAND_POSITION_MASK);
+  return true;
+}
+
+// dsp_c.send_command(type, target, value?) from the main thread, returns
+// false when the ring is full
+static int l_send_command(lua_State *L) {
+  int type = luaL_checkoption(L, 1, NULL, command_names);
+  int target = check_command_target(L, 2);
+  double value = luaL_optnumber(L, 3, 0);
+  lua_pushboolean(L, queue_command(type, target, value));
+  return 1;
+}
+
+// dsp_c.bind_value(target, value) on the audio thread, set_value commands for
+// target then write value. the value is kept alive until it's replaced
+static int l_bind_value(lua_State *L) {
+  int target = check_command_target(L, 1);
+  Value *value = luaL_checkudata(L, 2, VALUE_TYPE);
+  lua_getfield(L, LUA_REGISTRYINDEX, "dsp_c.bound_values");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "dsp_c.bound_values");
+  }
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, target);
+  lua_pop(L, 1);
+  bound_values[target] = value;
+  return 0;
+}
+
+// dsp_c.apply_commands() on the audio thread, returns a list of the commands
+// that aren't set_value as { type, target, value } tables, or nil if there
+// were none
+static int l_apply_commands(lua_State *L) {
+  int head = SHARED_LOAD(command_head);
+  int tail = SHARED_LOAD(command_tail);
+  int returned = 0;
+  for (; tail != head; tail = (tail + 1) & COMMAND_POSITION_MASK) {
+    Command *command = &command_queue[tail % COMMAND_QUEUE_SIZE];
+    if (command->type == COMMAND_SET_VALUE) {
+      if (bound_values[command->target]) {
+        bound_values[command->target]->value = command->value;
+      }
+      continue;
+    }
+    if (returned == 0) {
+      lua_newtable(L);
+    }
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, command_names[command->type]);
+    lua_setfield(L, -2, "type");
+    lua_pushinteger(L, command->target);
+    lua_setfield(L, -2, "target");
+    lua_pushnumber(L, command->value);
+    lua_setfield(L, -2, "value");
+    lua_rawseti(L, -2, ++returned);
+  }
+  SHARED_STORE(command_tail, tail);
+  if (returned == 0) {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// files
+//
+// offline renders stream interleaved float samples to a file through a large
+// stdio buffer, either as raw samples or as a 32 bit float wav whose sizes
+// are filled in when the file is closed. wav sizes are 32 bits, so a wav
+// stops taking frames short of 4 GiB, raw files have no limit
+
+#define FILE_WRITER_TYPE "dsp_c.file_writer"
+#define FILE_WRITER_BUFFER_SIZE (1 << 20)
+// the riff size counts the 50 bytes of header after it as well as the data
+#define MAX_WAV_DATA_SIZE (UINT32_MAX - 50)
+
+typedef struct {
+  FILE *file;
+  bool wav;
+  int channel_count;
+  int sample_rate;
+  uint64_t frame_count;
+} FileWriter;
+
+static void write_u16(FILE *file, uint16_t value) {
+  uint8_t bytes[2] = { value & 0xff, value >> 8 };
+  fwrite(bytes, 1, 2, file);
+}
+
+static void write_u32(FILE *file, uint32_t value) {
+  uint8_t bytes[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24 };
+  fwrite(bytes, 1, 4, file);
+}
+
+// wave_format_ieee_float needs a fact chunk, so the data starts at 58 bytes
+static void write_wav_header(FileWriter *writer) {
+  FILE *file = writer->file;
+  uint64_t data_size = writer->frame_count * writer->channel_count * sizeof(float);
+  fwrite("RIFF", 1, 4, file);
+  write_u32(file, (uint32_t) (50 + data_size));
+  fwrite("WAVEfmt ", 1, 8, file);
+  write_u32(file, 18);
+  write_u16(file, 3);
+  write_u16(file, writer->channel_count);
+  write_u32(file, writer->sample_rate);
+  write_u32(file, writer->sample_rate * writer->channel_count * sizeof(float));
+  write_u16(file, writer->channel_count * sizeof(float));
+  write_u16(file, 32);
+  write_u16(file, 0);
+  fwrite("fact", 1, 4, file);
+  write_u32(file, 4);
+  write_u32(file, (uint32_t) writer->frame_count);
+  fwrite("data", 1, 4, file);
+  write_u32(file, (uint32_t) data_size);
+}
+
+static bool is_little_endian(void) {
+  uint16_t probe = 1;
+  return *(uint8_t *) &probe == 1;
+}
+
+// dsp_c.open_file_writer(path, format, channel_count, sample_rate), format is
+// 'wav' or 'raw'
+static int l_open_file_writer(lua_State *L) {
+  static const char *const formats[] = { "wav", "raw", NULL };
+  const char *path = luaL_checkstring(L, 1);
+  bool wav = luaL_checkoption(L, 2, "wav", formats) == 0;
+  int channel_count = luaL_optinteger(L, 3, 2);
+  int sample_rate = luaL_optinteger(L, 4, (int) engine_sample_rate);
+  luaL_argcheck(L, channel_count > 0, 3, "channel_count must be positive");
+  luaL_argcheck(L, sample_rate > 0, 4, "sample_rate must be positive");
+
+  FileWriter *writer = lua_newuserdata(L, sizeof(FileWriter));
+  memset(writer, 0, sizeof(FileWriter));
+  luaL_getmetatable(L, FILE_WRITER_TYPE);
+  lua_setmetatable(L, -2);
+  writer->file = fopen(path, "wb");
+  if (!writer->file) {
+    return luaL_error(L, "couldn't open %s", path);
+  }
+  setvbuf(writer->file, NULL, _IOFBF, FILE_WRITER_BUFFER_SIZE);
+  writer->wav = wav;
+  writer->channel_count = channel_count;
+  writer->sample_rate = sample_rate;
+  if (wav) {
+    write_wav_header(writer);
+  }
+  return 1;
+}
+
+static FileWriter *check_open_file_writer(lua_State *L, int n) {
+  FileWriter *writer = luaL_checkudata(L, n, FILE_WRITER_TYPE);
+  if (!writer->file) {
+    luaL_error(L, "file writer is closed");
+  }
+  return writer;
+}
+
+// dsp_c.write_frames(writer, samples, frame_count), samples is a stream or a
+// pointer to interleaved samples
+static int l_write_frames(lua_State *L) {
+  FileWriter *writer = check_open_file_writer(L, 1);
+  const float *samples = check_pointer(L, 2);
+  int frame_count = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, frame_count >= 0, 3, "frame_count can't be negative");
+  size_t sample_count = (size_t) frame_count * writer->channel_count;
+  if (writer->wav && (writer->frame_count + frame_count) * writer->channel_count * sizeof(float) > MAX_WAV_DATA_SIZE) {
+    return luaL_error(L, "a wav can't hold more than 4 GiB of samples, write raw instead");
+  }
+  if (is_little_endian()) {
+    if (fwrite(samples, sizeof(float), sample_count, writer->file) != sample_count) {
+      return luaL_error(L, "couldn't write samples");
+    }
+  } else {
+    for (size_t i = 0; i < sample_count; i++) {
+      uint32_t bits;
+      memcpy(&bits, &samples[i], sizeof(bits));
+      write_u32(writer->file, bits);
+    }
+  }
+  writer->frame_count += frame_count;
+  return 0;
+}
+
+static void close_file_writer(FileWriter *writer) {
+  if (writer->wav && fseek(writer->file, 0, SEEK_SET) == 0) {
+    write_wav_header(writer);
+  }
+  fclose(writer->file);
+  writer->file = NULL;
+}
+
+// returns the number of frames written
+static int l_close_file_writer(lua_State *L) {
+  FileWriter *writer = check_open_file_writer(L, 1);
+  close_file_writer(writer);
+  lua_pushnumber(L, (lua_Number) writer->frame_count);
+  return 1;
+}
+
+static int l_file_writer_gc(lua_State *L) {
+  FileWriter *writer = luaL_checkudata(L, 1, FILE_WRITER_TYPE);
+  if (writer->file) {
+    close_file_writer(writer);
+  }
+  return 0;
+}
+
+// ffi
+//
+// the c abi declared in dsp_ffi.h, over the same state the lua functions use.
+// nothing here can raise a lua error, so it reports failures in its results
+
+DSP_FFI_DECLARATIONS(DSP_FFI_DECLARE)
+
+static const char ffi_cdef[] = DSP_FFI_DECLARATIONS(DSP_FFI_STRING);
+
+_Static_assert(offsetof(dsp_stream, samples) == offsetof(Stream, samples), "dsp_stream must start like Stream");
+_Static_assert(offsetof(dsp_stream, constant) == offsetof(Stream, constant), "dsp_stream must start like Stream");
+_Static_assert(offsetof(dsp_stream, value) == offsetof(Stream, value), "dsp_stream must start like Stream");
+_Static_assert(sizeof(dsp_value) == sizeof(Value), "dsp_value must match Value");
+_Static_assert(sizeof(dsp_command) == sizeof(Command), "dsp_command must match Command");
+
+// dsp_c.get_ffi_cdef() returns the declarations of dsp_ffi.h for ffi.cdef
+static int l_get_ffi_cdef(lua_State *L) {
+  lua_pushstring(L, ffi_cdef);
+  return 1;
+}
+
+DSP_API void dsp_fill(float *output, float value, int sample_count) {
+  kernels.fill(output, value, sample_count);
+}
+
+DSP_API void dsp_accumulate(float *output, float *const *inputs, int input_count, float initial, int sample_count) {
+  kernels.accumulate(output, inputs, input_count, initial, sample_count);
+}
+
+DSP_API void dsp_product(float *output, float *const *inputs, int input_count, float initial, int sample_count) {
+  kernels.product(output, inputs, input_count, initial, sample_count);
+}
+
+DSP_API void dsp_interleave(float *output_stereo, const float *input_left, const float *input_right, int sample_count) {
+  kernels.interleave(output_stereo, input_left, input_right, sample_count);
+}
+
+DSP_API void dsp_amplitude(float *output, const float *input_left, const float *input_right, int sample_count) {
+  kernels.amplitude(output, input_left, input_right, sample_count);
+}
+
+DSP_API void dsp_scale(float *output, const float *input, const float *gain, int sample_count) {
+  kernels.scale(output, input, gain, sample_count);
+}
+
+DSP_API void dsp_scale_interleave(float *output_stereo, const float *input_left, const float *input_right, const float *gain, int sample_count) {
+  kernels.scale_interleave(output_stereo, input_left, input_right, gain, sample_count);
+}
+
+DSP_API float dsp_peak(const float *input_left, const float *input_right, int sample_count) {
+  return kernels.peak(input_left, input_right, sample_count);
+}
+
+DSP_API int dsp_get_max_block_size(void) {
+  return engine_block_size;
+}
+
+DSP_API double dsp_get_sample_rate(void) {
+  return engine_sample_rate;
+}
+
+DSP_API int dsp_node_process(dsp_node *handle, int sample_count) {
+  Node *node = (Node *) handle;
+  // barriers are the nodes that call lua or run graphs
+  if (node->kind->barrier || sample_count < 0 || sample_count > engine_block_size) {
+    return -1;
+  }
+  Block block = { NULL, sample_count, .sample_rate = engine_sample_rate };
+  node->process(node, &block);
+  return block.hit_limiter;
+}
+
+// graphs call lua to schedule themselves and to run function nodes
+static bool graph_needs_lua(const Graph *graph) {
+  if (!graph->scheduled) {
+    return true;
+  }
+  for (int i = 0; i < graph->node_count; i++) {
+    Node *node = graph->nodes[i];
+    if (node->process == function_process) {
+      return true;
+    }
+    if (node->process == subgraph_process && graph_needs_lua(((SubgraphNode *) node)->graph)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+DSP_API int dsp_graph_process(dsp_graph *handle, int sample_count) {
+  Graph *graph = (Graph *) handle;
+  if (graph_needs_lua(graph) || sample_count < 0 || sample_count > engine_block_size) {
+    return -1;
+  }
+  Block block = { NULL, sample_count, .sample_rate = engine_sample_rate };
+  process_graph(graph, &block);
+  return block.hit_limiter;
+}
+
+// the queue of node if it's of the kind that process runs, or NULL
+static Event *queue_node_event(dsp_node *handle, NodeProcess process, int offset) {
+  Node *node = (Node *) handle;
+  if (node->process != process || offset < 0) {
+    return NULL;
+  }
+  if (process == set_process) {
+    return queue_event(&((SetNode *) node)->events, offset);
+  } else if (process == adsr_process) {
+    return queue_event(&((AdsrNode *) node)->events, offset);
+  }
+  return queue_event(&((VoicePoolNode *) node)->events, offset);
+}
+
+DSP_API bool dsp_set_value(dsp_node *node, float value, int offset) {
+  Event *event = queue_node_event(node, set_process, offset);
+  if (event) {
+    event->value = value;
+  }
+  return event;
+}
+
+DSP_API bool dsp_adsr_set_gate(dsp_node *node, bool gate, int offset) {
+  Event *event = queue_node_event(node, adsr_process, offset);
+  if (event) {
+    event->value = gate;
+  }
+  return event;
+}
+
+DSP_API bool dsp_voice_pool_note_on(dsp_node *node, int note, float frequency, float velocity, int offset) {
+  Event *event = queue_node_event(node, voice_pool_process, offset);
+  if (event) {
+    event->type = EVENT_NOTE_ON;
+    event->note = note;
+    event->value = frequency;
+    event->velocity = velocity;
+  }
+  return event;
+}
+
+DSP_API bool dsp_voice_pool_note_off(dsp_node *node, int note, int offset) {
+  Event *event = queue_node_event(node, voice_pool_process, offset);
+  if (event) {
+    event->type = EVENT_NOTE_OFF;
+    event->note = note;
+  }
+  return event;
+}
+
+DSP_API bool dsp_send_command(int type, int target, double value) {
+  if (type < COMMAND_SET_VALUE || type > COMMAND_SWAP_GRAPH || target < 0 || target >= MAX_BOUND_VALUES) {
+    return false;
+  }
+  return queue_command(type, target, value);
+}
+
+DSP_API int dsp_apply_commands(dsp_command *commands, int max_count) {
+  int head = SHARED_LOAD(command_head);
+  int tail = SHARED_LOAD(command_tail);
+  int returned = 0;
+  for (; tail != head; tail = (tail + 1) & COMMAND_POSITION_MASK) {
+    Command *command = &command_queue[tail % COMMAND_QUEUE_SIZE];
+    if (command->type == COMMAND_SET_VALUE) {
+      if (bound_values[command->target]) {
+        bound_values[command->target]->value = command->value;
+      }
+      continue;
+    }
+    if (returned == max_count) {
+      break;
+    }
+    commands[returned++] = (dsp_command) { command->type, command->target, command->value };
+  }
+  SHARED_STORE(command_tail, tail);
+  return returned;
+}
+
+static const luaL_Reg dsp_c_module[] = {
+  { "get_sample_rate", l_get_sample_rate },
+  { "set_sample_rate", l_set_sample_rate },
+  { "get_kernel_set", l_get_kernel_set },
+  { "get_max_block_size", l_get_max_block_size },
+  { "flush_denormals", l_flush_denormals },
+  { "get_ffi_cdef", l_get_ffi_cdef },
+  { "set_max_block_size", l_set_max_block_size },
+  { "new_stream", l_new_stream },
+  { "new_constant", l_new_constant },
+  { "set_constant", l_set_constant },
+  { "get_channel_count", l_get_channel_count },
+  { "new_value", l_new_value },
+  { "get_core_count", l_get_core_count },
+  { "new_graph", l_new_graph },
+  { "graph_add", l_graph_add },
+  { "graph_clear", l_graph_clear },
+  { "graph_set_outputs", l_graph_set_outputs },
+  { "graph_schedule", l_graph_schedule },
+  { "graph_process", l_graph_process },
+  { "wait", l_wait },
+  { "wake", l_wake },
+  { "get_time", l_get_time },
+  { "set_profiling", l_set_profiling },
+  { "read_profile", l_read_profile },
+  { "get_node_id", l_get_node_id },
+  { "set_value", l_set_value },
+  { "adsr_set_gate", l_adsr_set_gate },
+  { "voice_pool_note_on", l_voice_pool_note_on },
+  { "voice_pool_note_off", l_voice_pool_note_off },
+  { "voice_pool_active_count", l_voice_pool_active_count },
+  { "send_command", l_send_command },
+  { "bind_value", l_bind_value },
+  { "apply_commands", l_apply_commands },
+  { "open_file_writer", l_open_file_writer },
+  { "write_frames", l_write_frames },
+  { "close_file_writer", l_close_file_writer },
+  { "record_fill", l_record_fill },
+  { "record_render", l_record_render },
+  { "get_telemetry", l_get_telemetry },
+  { "reset_telemetry", l_reset_telemetry },
+  { NULL, NULL }
+};
+
+// every thread that uses dsp_c loads it, only the first load sets up the
+// state they share
+static shared_int module_loads;
+
+int luaopen_dsp_c(lua_State* L) {
+  if (SHARED_INCREMENT(module_loads) == 1) {
+    select_kernels();
+    init_filter_table();
+    init_limiter_recovery();
+    xoroshiro128plus_seed(noise_sequence);
+  }
+
+  luaL_newmetatable(L, STREAM_TYPE);
+  lua_pushcfunction(L, l_stream_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, VALUE_TYPE);
+  lua_pushcfunction(L, l_value_index);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_value_newindex);
+  lua_setfield(L, -2, "__newindex");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, NODE_TYPE);
+  lua_pushcfunction(L, l_node_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, GRAPH_TYPE);
+  lua_pushcfunction(L, l_graph_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, FILE_WRITER_TYPE);
+  lua_pushcfunction(L, l_file_writer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
 
-int luaopen_dsp_c(lua_State* L) {
   lua_newtable(L);
   luaL_register(L, NULL, dsp_c_module);
+
+  // dsp_c.new_<kind> and dsp_c.<kind> for every node kind
+  for (const NodeKind *kind = node_kinds; kind->name; kind++) {
+    lua_pushfstring(L, "new_%s", kind->name);
+    lua_pushlightuserdata(L, (void *) kind);
+    lua_pushcclosure(L, l_new_node, 1);
+    lua_settable(L, -3);
+
+    lua_pushlightuserdata(L, (void *) kind);
+    lua_pushcclosure(L, l_process_node, 1);
+    lua_setfield(L, -2, kind->name);
+  }
   return 1;
 }
@@ -1,110 +1,348 @@
 /** @noSelfInFile **/
 
+export type Graph = LuaUserdata & { __graph: true }
+export type Node<Kind extends string = string> = LuaUserdata & { __node: Kind }
+
 export function get_sample_rate(): number
+// set before building anything, nodes read it as they run
+export function set_sample_rate(sample_rate: number): void
+
+// flushes denormals to zero on this thread and on the worker threads of
+// every graph, call it on the thread that runs graphs. nodes rely on it
+// instead of guarding their loops
+export function flush_denormals(): void
+
+// the declarations of dsp_ffi.h for luajit's ffi.cdef, a c abi for the
+// kernels, running nodes and graphs, queuing events and the command queue
+export function get_ffi_cdef(): string
+
+// which simd kernels were selected for this cpu: 'scalar', 'avx2' or 'neon'
+export function get_kernel_set(): string
+
+// blocks can't be longer than this, 512 unless it's set before any stream is
+// made. common block sizes get kernels specialized for them
+export function get_max_block_size(): number
+// between 1 and 2048
+export function set_max_block_size(block_size: number): void
+
+// an aligned buffer of get_max_block_size() samples per channel for nodes to
+// write, channels are stored one after another
+export function new_stream(channel_count?: number): LuaUserdata
+
+export function get_channel_count(stream: LuaUserdata): number
+
+// a stream that holds value and has no buffer
+export function new_constant(value?: number): LuaUserdata
+
+// makes a stream hold value until a node writes to it again
+export function set_constant(stream: LuaUserdata, value: number): void
+
+export function new_value(value?: number): [number]
+
+// number of cpu cores, 1 where the graph can't use worker threads
+export function get_core_count(): number
+
+// nodes that don't depend on each other are split between worker_count
+// worker threads and the thread calling graph_process. given a graph instead,
+// the new one shares its workers, and the two mustn't run at the same time
+export function new_graph(worker_count?: number | Graph): Graph
+
+export function graph_add<N extends Node>(graph: Graph, node: N): N
+
+// removes every node and output so the graph can be built again
+export function graph_clear(graph: Graph): void
+
+// schedules a changed graph ahead of its next block instead of in it
+export function graph_schedule(graph: Graph): void
+
+// only the nodes the outputs depend on run, found by walking back through the
+// streams and delay buffers the nodes use. an empty list runs every node
+export function graph_set_outputs(graph: Graph, outputs: LuaUserdata[]): void
+
+// runs every node in the graph, returns whether a limiter was hit
+export function graph_process(graph: Graph, sample_count: number): boolean
+
+// blocks for at most seconds or until wake is called from any thread,
+// returns whether it was woken
+export function wait(seconds: number): boolean
+export function wake(): void
+
+// seconds on a monotonic clock
+export function get_time(): number
+
+export type Telemetry = {
+  underruns: number
+  overruns: number
+  fill_frames: number
+  min_fill_frames: number
+  output_frames: number
+  blocks: number
+  // blocks in which a limiter brought the gain down
+  limiter_hits: number
+  worst_render_seconds: number
+  // worst render time as a fraction of the block's duration
+  worst_render_load: number
+}
+
+// the audio thread records the output's state, any thread can read it
+// without ever making the audio thread wait. a reset applies from the audio
+// thread's next record
+export function record_fill(fill_frames: number, output_frames: number, underrun: boolean): void
+export function record_render(render_seconds: number, block_seconds: number, overrun: boolean, hit_limiter?: boolean): void
+export function get_telemetry(): Telemetry
+export function reset_telemetry(): void
+
+export type ProfileEntry = {
+  nanoseconds: number
+  calls: number
+}
+
+export type Profile = {
+  // time spent in graphs as a fraction of the audio they rendered
+  load: number
+  blocks: number
+  // blocks whose records didn't fit in the ring
+  dropped: number
+  kinds: LuaTable<string, ProfileEntry>
+  nodes: LuaTable<number, ProfileEntry & { kind: string }>
+}
 
-export function set(state: {
-  sample_count: number
+// graphs time every node while profiling is on, read_profile returns and
+// clears what was recorded since the last read, from any one lua state
+export function set_profiling(enabled: boolean): void
+export function read_profile(): Profile
+export function get_node_id(node: Node): number
+
+export type CommandType = 'set_value' | 'connect' | 'disconnect' | 'swap_graph'
+
+export type Command = {
+  type: CommandType
+  target: number
+  value: number
+}
+
+// a lock free ring from the main thread to the audio thread. send_command
+// returns false when the ring is full. the audio thread binds values to
+// targets, apply_commands writes them for set_value and returns every other
+// command
+export function send_command(type: CommandType, target: number, value?: number): boolean
+export function bind_value(target: number, value: [number]): void
+export function apply_commands(): Command[] | undefined
+
+export type FileWriter = LuaUserdata & { __file_writer: true }
+export type FileFormat = 'wav' | 'raw'
+
+// writes interleaved 32 bit float samples, raw or as a wav. a wav holds at
+// most 4 GiB of samples, write_frames raises an error past that
+export function open_file_writer(path: string, format?: FileFormat, channel_count?: number, sample_rate?: number): FileWriter
+export function write_frames(writer: FileWriter, samples: LuaUserdata, frame_count: number): void
+// returns the number of frames written
+export function close_file_writer(writer: FileWriter): number
+
+// add, multiply, lowpass and highpass process every channel of their output
+// in one call, their inputs have either one channel or as many as the output
+//
+// every node kind has a constructor that reads its state once, and a function
+// that runs the node for one block
+//
+// silence is a constant 0: idle nodes write it instead of samples, multiply
+// outputs it when any input is silent, add skips silent inputs, and filters
+// whose input is constant write constants once they've settled on it
+//
+// functions that queue events take an offset in samples from the start of the
+// next block the node runs, events past its end move on to the following one
+
+export function new_set(state: {
   output: LuaUserdata
   value: number
-}): void
+}): Node<'set'>
+export function set(node: Node<'set'>, sample_count: number): void
+export function set_value(node: Node<'set'>, value: number, offset?: number): void
 
-export function add(state: {
-  sample_count: number
+export function new_add(state: {
   output: LuaUserdata
   inputs: LuaUserdata[]
-}): void
+}): Node<'add'>
+export function add(node: Node<'add'>, sample_count: number): void
 
-export function multiply(state: {
-  sample_count: number
+export function new_multiply(state: {
   output: LuaUserdata
   inputs: LuaUserdata[]
-}): void
+}): Node<'multiply'>
+export function multiply(node: Node<'multiply'>, sample_count: number): void
 
-export function lowpass(state: {
-  sample_count: number
+export function new_lowpass(state: {
   output: LuaUserdata
   input: LuaUserdata
   input_cutoff: LuaUserdata
   last_value?: number
-}): void
+  // calculate the coefficient every control_rate samples and interpolate
+  control_rate?: number
+  // use a lookup table for the coefficient instead of cosf and sqrtf
+  approximate?: boolean
+}): Node<'lowpass'>
+export function lowpass(node: Node<'lowpass'>, sample_count: number): void
 
-export function highpass(state: {
-  sample_count: number
+export function new_highpass(state: {
   output: LuaUserdata
   input: LuaUserdata
   input_cutoff: LuaUserdata
   last_value?: number
-}): void
+  // calculate the coefficient every control_rate samples and interpolate
+  control_rate?: number
+  // use a lookup table for the coefficient instead of cosf and sqrtf
+  approximate?: boolean
+}): Node<'highpass'>
+export function highpass(node: Node<'highpass'>, sample_count: number): void
 
-export function triangle(state: {
-  sample_count: number
+export function new_triangle(state: {
   output: LuaUserdata
   input_frequency: LuaUserdata
   input_duty: LuaUserdata
   phase?: number
-}): void
+}): Node<'triangle'>
+export function triangle(node: Node<'triangle'>, sample_count: number): void
+
+export function new_oscillator_bank(state: {
+  outputs: LuaUserdata[]
+  inputs_frequency: LuaUserdata[]
+  inputs_duty?: LuaUserdata[]
+  shape?: 'triangle' | 'saw' | 'square' | 'sine'
+}): Node<'oscillator_bank'>
+export function oscillator_bank(node: Node<'oscillator_bank'>, sample_count: number): void
 
-export function adsr(state: {
-  sample_count: number
+// the output is a constant 0 once the envelope has released
+export function new_adsr(state: {
   output: LuaUserdata
-  input_gate: LuaUserdata
-  attack: number
-  decay: number
-  sustain: number
-  release: number
+  // without input_gate the gate is set with adsr_set_gate
+  input_gate?: LuaUserdata
+  attack: [number]
+  decay: [number]
+  sustain: [number]
+  release: [number]
   stage?: number
   value?: number
   release_delta?: number
-}): void
-
-export function stereo_limiter(state: {
-  sample_count: number
-  output_left: LuaUserdata
-  output_right: LuaUserdata
-  input_left: LuaUserdata
-  input_right: LuaUserdata
-  hit_limiter?: boolean
-}): void
-
-export function stereo_interleave(state: {
-  sample_count: number
+}): Node<'adsr'>
+export function adsr(node: Node<'adsr'>, sample_count: number): void
+export function adsr_set_gate(node: Node<'adsr'>, gate: boolean, offset?: number): void
+
+// blocks that stay under 1 pass through untouched. with lookahead the output
+// is that many samples late and the gain ramps down across the lookahead
+// ahead of every peak, so it never goes over 1. lookahead is at most
+// get_max_block_size(). with output_stereo it interleaves into that pointer
+// instead of the output streams
+//
+// stereo nodes take left and right streams, or instead one stream with 2
+// channels as output or input
+export function new_stereo_limiter(state: {
+  output_left?: LuaUserdata
+  output_right?: LuaUserdata
+  output?: LuaUserdata
+  output_stereo?: LuaUserdata
+  input_left?: LuaUserdata
+  input_right?: LuaUserdata
+  input?: LuaUserdata
+  divisor?: number
+  lookahead?: number
+}): Node<'stereo_limiter'>
+// returns whether it limited the block
+export function stereo_limiter(node: Node<'stereo_limiter'>, sample_count: number): boolean
+
+// sample_count is the number of stereo frames to output
+export function new_stereo_interleave(state: {
   output_stereo: LuaUserdata
-  input_left: LuaUserdata
-  input_right: LuaUserdata
-}): void
+  input_left?: LuaUserdata
+  input_right?: LuaUserdata
+  input?: LuaUserdata
+}): Node<'stereo_interleave'>
+export function stereo_interleave(node: Node<'stereo_interleave'>, sample_count: number): void
+
+// the buffer is rounded up to a power of two of at least buffer_size samples
+export type Interpolation = 'none' | 'linear' | 'cubic'
 
-export function delay_writer(state: {
-  sample_count: number
-  buffer: LuaUserdata
+export function new_delay_buffer(state: {
+  max_block_size: number
+  max_delay_samples: number
   buffer_size: number
-  write_index: number
+}): Node<'delay_buffer'>
+export function delay_buffer(node: Node<'delay_buffer'>, sample_count: number): void
+
+export function new_delay_writer(state: {
+  delay_buffer: Node<'delay_buffer'>
   input: LuaUserdata
-}): void
+}): Node<'delay_writer'>
+export function delay_writer(node: Node<'delay_writer'>, sample_count: number): void
 
-export function delay_reader(state: {
-  sample_count: number
-  buffer: LuaUserdata
-  buffer_size: number
-  read_index: number
-  min_delay_samples: number
-  max_delay_samples: number
+export function new_delay_reader(state: {
+  delay_buffer: Node<'delay_buffer'>
   output: LuaUserdata
   input_delay_time: LuaUserdata
-}): void
+  interpolation?: Interpolation
+}): Node<'delay_reader'>
+export function delay_reader(node: Node<'delay_reader'>, sample_count: number): void
+
+export function new_white_noise(state: {
+  output: LuaUserdata
+  seed?: number
+}): Node<'white_noise'>
+export function white_noise(node: Node<'white_noise'>, sample_count: number): void
 
-export function white_noise(state: {
-  sample_count: number
+export function new_pink_noise(state: {
   output: LuaUserdata
-}): void
+  seed?: number
+}): Node<'pink_noise'>
+export function pink_noise(node: Node<'pink_noise'>, sample_count: number): void
 
-export function pink_noise(state: {
-  sample_count: number
+// a polyphonic instrument, every voice is an oscillator through an envelope
+// and an optional lowpass mixed into output. when every voice is busy a note
+// steals the oldest or the quietest one
+export function new_voice_pool(state: {
   output: LuaUserdata
-  b0?: number
-  b1?: number
-  b2?: number
-  b3?: number
-  b4?: number
-  b5?: number
-  b6?: number
-}): void
+  voice_count: number
+  shape?: 'triangle' | 'saw' | 'square' | 'sine'
+  attack: [number]
+  decay: [number]
+  sustain: [number]
+  release: [number]
+  cutoff?: [number]
+  steal?: 'oldest' | 'quietest'
+}): Node<'voice_pool'>
+export function voice_pool(node: Node<'voice_pool'>, sample_count: number): void
+export function voice_pool_note_on(node: Node<'voice_pool'>, note: number, frequency: number, velocity?: number, offset?: number): void
+// releases every voice playing note
+export function voice_pool_note_off(node: Node<'voice_pool'>, note: number, offset?: number): void
+export function voice_pool_active_count(node: Node<'voice_pool'>): number
+
+// convolves input with every impulse response into the output at the same
+// index, with uniformly partitioned fft convolution. the input is transformed
+// once per partition for all of them. impulse responses are paths to 32 bit
+// float wavs, whose first channel is used, or raw mono float files, which are
+// mapped rather than read, or arrays of samples. the outputs are
+// partition_size samples late, which is a power of two from 16 to 2048 and
+// defaults to the largest one up to 512 that fits in a block, at least 16
+export function new_convolver(state: {
+  input: LuaUserdata
+  outputs: LuaUserdata[]
+  impulse_responses: (string | number[])[]
+  partition_size?: number
+}): Node<'convolver'>
+export function convolver(node: Node<'convolver'>, sample_count: number): void
+
+// runs graph at factor times the rate of the graph the node is in, or at
+// 1 / factor of it without oversample. inputs are resampled into inner_inputs
+// and inner_outputs back into outputs, the inner streams are mono and only
+// used inside graph. decimated outputs come back factor samples late
+export function new_subgraph(state: {
+  graph: Graph
+  factor: number
+  oversample?: boolean
+  inputs: LuaUserdata[]
+  inner_inputs: LuaUserdata[]
+  inner_outputs: LuaUserdata[]
+  outputs: LuaUserdata[]
+}): Node<'subgraph'>
+export function subgraph(node: Node<'subgraph'>, sample_count: number): void
+
+// function nodes call back into lua
+export function new_function(fn: (this: any) => void): Node<'function'>
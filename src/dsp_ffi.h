@@ -0,0 +1,66 @@
+// the plain c abi of dsp_c, for luajit's ffi
+//
+// the lua functions in dsp_c.c abort jit traces, these don't. nodes, graphs,
+// streams and values are the full userdata dsp_c hands to lua, which the ffi
+// converts to pointers to their contents, e.g. ffi.cast('dsp_node *', node).
+// lua keeps them alive, so a pointer is only good while its userdata is
+//
+// the declarations are only written here: dsp_c.c compiles them and
+// dsp_c.get_ffi_cdef() returns them as text for ffi.cdef, so they have to stay
+// plain c that the ffi parses, without the preprocessor
+
+#ifndef DSP_FFI_H
+#define DSP_FFI_H
+
+#include <stdbool.h>
+
+#ifdef _WIN32
+#define DSP_API __declspec(dllexport)
+#else
+#define DSP_API __attribute__((visibility("default")))
+#endif
+
+#define DSP_FFI_DECLARATIONS(declare) declare( \
+  typedef struct dsp_node dsp_node; \
+  typedef struct dsp_graph dsp_graph; \
+  /* the start of a stream, samples must not be read while constant is set */ \
+  typedef struct { float *samples; bool constant; float value; } dsp_stream; \
+  typedef struct { double value; } dsp_value; \
+  /* type is 0 set_value, 1 connect, 2 disconnect or 3 swap_graph */ \
+  typedef struct { int type; int target; double value; } dsp_command; \
+  \
+  /* the kernels the nodes are built from, for the selected kernel set */ \
+  void dsp_fill(float *output, float value, int sample_count); \
+  void dsp_accumulate(float *output, float *const *inputs, int input_count, float initial, int sample_count); \
+  void dsp_product(float *output, float *const *inputs, int input_count, float initial, int sample_count); \
+  void dsp_interleave(float *output_stereo, const float *input_left, const float *input_right, int sample_count); \
+  void dsp_amplitude(float *output, const float *input_left, const float *input_right, int sample_count); \
+  void dsp_scale(float *output, const float *input, const float *gain, int sample_count); \
+  void dsp_scale_interleave(float *output_stereo, const float *input_left, const float *input_right, const float *gain, int sample_count); \
+  float dsp_peak(const float *input_left, const float *input_right, int sample_count); \
+  \
+  int dsp_get_max_block_size(void); \
+  double dsp_get_sample_rate(void); \
+  \
+  /* run a block, returning whether a limiter was hit, or -1 without running */ \
+  /* anything when it would call back into lua or the graph isn't scheduled */ \
+  int dsp_node_process(dsp_node *node, int sample_count); \
+  int dsp_graph_process(dsp_graph *graph, int sample_count); \
+  \
+  /* queue events like the lua functions, false for the wrong kind of node, */ \
+  /* a negative offset or a full queue */ \
+  bool dsp_set_value(dsp_node *node, float value, int offset); \
+  bool dsp_adsr_set_gate(dsp_node *node, bool gate, int offset); \
+  bool dsp_voice_pool_note_on(dsp_node *node, int note, float frequency, float velocity, int offset); \
+  bool dsp_voice_pool_note_off(dsp_node *node, int note, int offset); \
+  \
+  /* the command queue, apply_commands writes at most max_count commands */ \
+  /* that aren't set_value and returns how many, leaving the rest queued */ \
+  bool dsp_send_command(int type, int target, double value); \
+  int dsp_apply_commands(dsp_command *commands, int max_count); \
+)
+
+#define DSP_FFI_DECLARE(...) __VA_ARGS__
+#define DSP_FFI_STRING(...) #__VA_ARGS__
+
+#endif
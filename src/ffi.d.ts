@@ -0,0 +1,9 @@
+/** @noSelfInFile **/
+
+// the parts of luajit's ffi library that dsp uses
+
+export type CData = LuaUserdata & { __cdata: true }
+
+export function cdef(declarations: string): void
+export function load(path: string): any
+export function cast(type: string, value: any): CData
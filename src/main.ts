@@ -1,3 +1,5 @@
+import * as control from 'audio/control'
+
 lovr.load = () => {
   const thread = lovr.thread.newThread(`
     require 'lovr.filesystem'
@@ -13,6 +15,16 @@ lovr.load = () => {
   thread.start()
 }
 
-lovr.update = (dt) => {
+// swaps the audio thread's patch every couple of seconds
+const patch_seconds = 2
+let patch = 1
+let patch_time = 0
 
+lovr.update = (dt) => {
+  patch_time += dt
+  if (patch_time >= patch_seconds) {
+    patch_time -= patch_seconds
+    patch = patch === 1 ? 2 : 1
+    control.swap_patch(patch)
+  }
 }
@@ -45,10 +45,10 @@ static inline uint64_t rotl(const uint64_t x, int k) {
 	return (x << k) | (x >> (64 - k));
 }
 
-// seeded from https://www.random.org/bytes/
-static uint64_t s[2] = { 0xc457ab774cdb3565, 0xdcac4a6470e841b7 };
+// the state is passed in so each caller can own an independent generator,
+// see xoroshiro128plus_seed for the default starting point
 
-uint64_t next(void) {
+uint64_t xoroshiro128plus_next(uint64_t s[2]) {
 	const uint64_t s0 = s[0];
 	uint64_t s1 = s[1];
 	const uint64_t result = s0 + s1;
@@ -65,7 +65,7 @@ uint64_t next(void) {
    to 2^64 calls to next(); it can be used to generate 2^64
    non-overlapping subsequences for parallel computations. */
 
-void jump(void) {
+void xoroshiro128plus_jump(uint64_t s[2]) {
 	static const uint64_t JUMP[] = { 0xdf900294d8f554a5, 0x170865df4b3201fc };
 
 	uint64_t s0 = 0;
@@ -76,7 +76,7 @@ void jump(void) {
 				s0 ^= s[0];
 				s1 ^= s[1];
 			}
-			next();
+			xoroshiro128plus_next(s);
 		}
 
 	s[0] = s0;
@@ -89,7 +89,7 @@ void jump(void) {
    from each of which jump() will generate 2^32 non-overlapping
    subsequences for parallel distributed computations. */
 
-void long_jump(void) {
+void xoroshiro128plus_long_jump(uint64_t s[2]) {
 	static const uint64_t LONG_JUMP[] = { 0xd2a98b26625eee7b, 0xdddf9b1090aa7ac1 };
 
 	uint64_t s0 = 0;
@@ -100,9 +100,29 @@ void long_jump(void) {
 				s0 ^= s[0];
 				s1 ^= s[1];
 			}
-			next();
+			xoroshiro128plus_next(s);
 		}
 
 	s[0] = s0;
 	s[1] = s1;
 }
+
+
+// seeded from https://www.random.org/bytes/
+void xoroshiro128plus_seed(uint64_t s[2]) {
+	s[0] = 0xc457ab774cdb3565;
+	s[1] = 0xdcac4a6470e841b7;
+}
+
+
+/* Seeds a state from a single 64 bit value by running it through
+   splitmix64, as suggested above. The result is never all zero. */
+
+void xoroshiro128plus_seed_from(uint64_t s[2], uint64_t seed) {
+	for (int i = 0; i < 2; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		s[i] = z ^ (z >> 31);
+	}
+}
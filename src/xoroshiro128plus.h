@@ -2,4 +2,8 @@
 
 #include <stdint.h>
 
-uint64_t next(void);
+uint64_t xoroshiro128plus_next(uint64_t s[2]);
+void xoroshiro128plus_jump(uint64_t s[2]);
+void xoroshiro128plus_long_jump(uint64_t s[2]);
+void xoroshiro128plus_seed(uint64_t s[2]);
+void xoroshiro128plus_seed_from(uint64_t s[2], uint64_t seed);